@@ -34,13 +34,21 @@ This file is part of AYAB.
 /*
  * DEFINES
  */
+#define MAX_MSG_LEN      29  // cnfLine: msgid, line number, 25 bytes, flags, crc
+#define MSG_TIMEOUT      100 // ms, incomplete message is discarded when no more bytes arrive
 
 
 /*
  *  DECLARATIONS
  */ 
 Knitter     *knitter;
-byte        lineBuffer[25];
+byte        lineBuffer[LINE_BUFFER_COUNT*25];
+
+// message being received
+byte          rxMsg[MAX_MSG_LEN];
+byte          rxLen      = 0;  // bytes received so far
+byte          rxExpected = 0;  // length of message being received, 0 = none
+unsigned long rxLastByte = 0;  // millis() of last byte received
 
 /*! Mapping of Pin EncA to its ISR
  *
@@ -54,19 +62,55 @@ void isr_encA()
 /*
  * Serial Command handling
  */
- void h_reqStart()
+
+/*! Length of a message from the host
+ *  \return 0 for unknown message ids
+ */
+byte msgLength(byte msgid)
+{
+  switch( msgid )
+  {
+    case reqStart_msgid: return 3;  // msgid, start needle, stop needle
+    case cnfLine_msgid:  return 29; // msgid, line number, 25 bytes, flags, crc
+    case reqInfo_msgid:  return 1;
+    case reqTest_msgid:  return 1;
+    default:             return 0;
+  }
+}
+
+
+/*! CRC8 (polynomial 0x07, start value 0) as calculated by the host */
+byte crc8(const byte *data, byte len)
+{
+  byte _crc = 0;
+  while( len-- )
+  {
+    _crc ^= *data++;
+    for( byte i = 0; i < 8; i++ )
+    {
+      _crc = (_crc & 0x80) ? (_crc << 1) ^ 0x07 : (_crc << 1);
+    }
+  }
+  return _crc;
+}
+
+
+ void h_reqStart(const byte *msg)
  {
-  delay(50); //DEBUG wait for data to arrive
-  byte _startNeedle = Serial.read();
-  byte _stopNeedle  = Serial.read();
+  byte _startNeedle = msg[1];
+  byte _stopNeedle  = msg[2];
   
   // TODO verify operation
   //memset(lineBuffer,0,sizeof(lineBuffer));
   // temporary solution
-  for( int i = 0; i < 25; i++)
+  // (not when reconfiguring a running operation, buffer holds the current line then)
+  if( !knitter->isOperating() )
   {
-    lineBuffer[i] = 0xFF;
-  }  
+    for( int i = 0; i < LINE_BUFFER_COUNT*25; i++)
+    {
+      lineBuffer[i] = 0xFF;
+    }  
+  }
 
   bool _success = knitter->startOperation(_startNeedle, 
                                           _stopNeedle, 
@@ -77,28 +121,29 @@ void isr_encA()
  }
 
 
- void h_cnfLine()
+ void h_cnfLine(const byte *msg)
  {
-  delay(50); //DEBUG wait for data to arrive
-  byte _lineNumber = 0;
-  byte _flags = 0;
-  byte _crc8  = 0;
+  byte _lineNumber = msg[1];
+  byte _flags      = msg[27];
+  byte _crc8       = msg[28];
   bool _flagLastLine = false;
+  byte *_buffer;
 
-  _lineNumber = Serial.read();
-
-  for( int i = 0; i < 25; i++ )
-  { // Values have to be inverted because of needle states
-    lineBuffer[i] = ~Serial.read();
+  if( crc8(msg, 28) != _crc8 )
+  { // corrupted on the way, have it sent again
+    knitter->repeatLineRequest();
+    return;
   }
-  _flags = Serial.read();
-  _crc8  = Serial.read();
 
-  // TODO insert CRC8 check
-
-  if(knitter->setNextLine(_lineNumber))
+  _buffer = knitter->setNextLine(_lineNumber);
+  if( NULL != _buffer )
   { // Line was accepted
-    _flagLastLine = bitRead(_flags, 0);
+    for( int i = 0; i < 25; i++ )
+    { // Values have to be inverted because of needle states
+      _buffer[i] = ~msg[2+i];
+    }
+    knitter->setPrefetch(bitRead(_flags, LINEFLAG_PREFETCH));
+    _flagLastLine = bitRead(_flags, LINEFLAG_LASTLINE);
     if( _flagLastLine )
     {
       knitter->setLastLine();
@@ -131,6 +176,33 @@ void h_unrecognized()
 }
 
 
+void dispatch(const byte *msg)
+{
+  switch( msg[0] )
+  {
+    case reqStart_msgid:
+      h_reqStart(msg);
+      break;
+
+    case cnfLine_msgid:
+      h_cnfLine(msg);
+      break;
+
+    case reqInfo_msgid:
+      h_reqInfo();
+      break;
+
+    case reqTest_msgid:
+      h_reqTest();
+      break;
+
+    default:
+      h_unrecognized();
+      break;
+  }
+}
+
+
 /*
  * SETUP
  */
@@ -159,33 +231,33 @@ void loop() {
 
   knitter->fsm();
 
-
-  if( Serial.available() )
+  // collect the bytes of a message as they arrive, handle it when complete
+  while( Serial.available() )
   {
-    char inChar = (char)Serial.read();
-    switch( inChar )
-    {
-      case reqStart_msgid:
-        h_reqStart();
-        break;
-
-      case cnfLine_msgid:
-        h_cnfLine();
-        break;
-
-      case reqInfo_msgid:
-        h_reqInfo();
-        break;
-
-      case reqTest_msgid:
-        h_reqTest();
-        break;
-
-      default:
+    byte _b = Serial.read();
+    if( 0 == rxExpected )
+    { // start of a message
+      rxExpected = msgLength(_b);
+      rxLen = 0;
+      if( 0 == rxExpected )
+      {
         h_unrecognized();
-        break;
+        continue;
+      }
+    }
+    rxMsg[rxLen++] = _b;
+    rxLastByte = millis();
+    if( rxLen >= rxExpected )
+    {
+      rxExpected = 0;
+      dispatch(rxMsg);
+      break; // one message per loop, fsm must run in between
     }
   }
-}
 
+  if( 0 != rxExpected && (millis() - rxLastByte) > MSG_TIMEOUT )
+  { // rest of the message got lost
+    rxExpected = 0;
+  }
+}
 
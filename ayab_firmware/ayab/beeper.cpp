@@ -25,7 +25,9 @@ This file is part of AYAB.
 
 Beeper::Beeper()
 {
-  // Intentionally left blank
+	m_state        = BeepIdle;
+	m_beepsPending = 0;
+	m_nextChange   = 0;
 }
 
 
@@ -47,17 +49,59 @@ void Beeper::endWork()
 }
 
 
+void Beeper::schedule()
+{
+	unsigned long _now = millis();
+
+	switch( m_state ) {
+		case BeepIdle:
+			if( 0 == m_beepsPending )
+			{
+				return;
+			}
+			break;
+
+		case BeepOn:
+			if( (long)(_now - m_nextChange) < 0 )
+			{
+				return;
+			}
+			analogWrite(PIEZO_PIN, 20);
+			m_state      = BeepOff;
+			m_nextChange = _now + BEEPDELAY;
+			return;
+
+		case BeepOff:
+			if( (long)(_now - m_nextChange) < 0 )
+			{
+				return;
+			}
+			if( 0 == m_beepsPending )
+			{	// sequence done
+				analogWrite(PIEZO_PIN, 255);
+				m_state = BeepIdle;
+				return;
+			}
+			break;
+	}
+	// start next beep
+	m_beepsPending--;
+	analogWrite(PIEZO_PIN, 0);
+	m_state      = BeepOn;
+	m_nextChange = _now + BEEPDELAY;
+}
+
+
 /*
  * PRIVATE METHODS
  */
 void Beeper::beep( byte length )
-{	
-    for(int i=0;i<length;i++)
-    {
-      analogWrite(PIEZO_PIN, 0);
-      delay(BEEPDELAY);
-      analogWrite(PIEZO_PIN, 20);       
-      delay(BEEPDELAY);
-    }
-    analogWrite(PIEZO_PIN, 255);
-}
\ No newline at end of file
+{
+	// queue behind beeps still playing
+	unsigned int _pending = m_beepsPending + length;
+	m_beepsPending = _pending > 255 ? 255 : _pending;
+	if( BeepIdle == m_state )
+	{
+		schedule();
+	}
+}
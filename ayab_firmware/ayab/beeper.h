@@ -25,8 +25,17 @@ This file is part of AYAB.
 #include "Arduino.h"
 #include "settings.h"
 
+typedef enum BeepState{
+	BeepIdle = 0,
+	BeepOn   = 1,
+	BeepOff  = 2
+} BeepState_t;
+
 /*!
  *  Class to actuate a beeper connected to PIEZO_PIN
+ *
+ *  Beeps do not block: they are queued and played by schedule(),
+ *  which must be called from the main loop.
  */
 class Beeper{
 public:
@@ -38,9 +47,15 @@ public:
 	void finishedLine();
     /*! Beep to indicate the end the knitting pattern */
 	void endWork();
+    /*! Advance the beep sequence, call as often as possible */
+	void schedule();
 
 private:
 	void beep(byte length);
+
+	BeepState_t   m_state;
+	byte          m_beepsPending;  // beeps queued, not yet started
+	unsigned long m_nextChange;    // millis() when current on/off phase ends
 };
 
 #endif
\ No newline at end of file
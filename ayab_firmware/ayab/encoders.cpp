@@ -23,6 +23,24 @@ This file is part of AYAB.
 #include "encoders.h"
 
 
+// Hall sensor values, updated continuously by the ADC interrupt.
+// Start in between the filter limits, i.e. no hall sensor active.
+static volatile uint16 s_hallValue[2] = {  // [0]: left, [1]: right
+  (FILTER_L_MIN + FILTER_L_MAX) / 2,
+  (FILTER_R_MIN + FILTER_R_MAX) / 2
+};
+static volatile byte s_hallChannel = 0;    // sensor being converted
+
+ISR(ADC_vect)
+{
+  s_hallValue[s_hallChannel] = ADC;
+  // convert the other sensor next
+  s_hallChannel ^= 1;
+  ADMUX = _BV(REFS0) | (s_hallChannel ? EOL_PIN_R : EOL_PIN_L);
+  ADCSRA |= _BV(ADSC);
+}
+
+
 Encoders::Encoders()
 {
 	m_direction    = NoDirection;
@@ -33,12 +51,32 @@ Encoders::Encoders()
 }
 
 
+void Encoders::init()
+{
+  // digitalRead() is too slow for the ISR, look up port and bit once
+  m_encA_port = portInputRegister(digitalPinToPort(ENC_PIN_A));
+  m_encB_port = portInputRegister(digitalPinToPort(ENC_PIN_B));
+  m_encC_port = portInputRegister(digitalPinToPort(ENC_PIN_C));
+  m_encA_mask = digitalPinToBitMask(ENC_PIN_A);
+  m_encB_mask = digitalPinToBitMask(ENC_PIN_B);
+  m_encC_mask = digitalPinToBitMask(ENC_PIN_C);
+
+  // analogRead() takes ~100us, convert the hall sensors in the background instead:
+  // AVcc reference (as analogRead()), prescaler 128 (125kHz ADC clock at 16MHz),
+  // each completed conversion starts the next one in the ADC interrupt
+  s_hallChannel = 0;
+  ADMUX  = _BV(REFS0) | EOL_PIN_L;
+  ADCSRB = 0; // MUX5 (Mega) cleared, A0..A7
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0) | _BV(ADSC);
+}
+
+
 void Encoders::encA_interrupt()
 {
    m_hallActive = NoDirection;
 
    static bool _oldState = false;
-   bool _curState=digitalRead(ENC_PIN_A);
+   bool _curState = (*m_encA_port & m_encA_mask) != 0;
 
    if( !_oldState && _curState )
    {
@@ -58,7 +96,7 @@ void Encoders::encA_interrupt()
 void Encoders::encA_rising()
 {
 	// Direction only decided on rising edge of encoder A
-	m_direction = digitalRead(ENC_PIN_B) ? Right : Left;
+	m_direction = (*m_encB_port & m_encB_mask) ? Right : Left;
 	/*
    if( Right == m_direction )
 	{
@@ -77,7 +115,7 @@ void Encoders::encA_rising()
         m_encoderPos++;
       }
 
-		uint16 hallValue = analogRead(EOL_PIN_L);
+		uint16 hallValue = s_hallValue[0];
 		if( hallValue < FILTER_L_MIN || 
 			hallValue > FILTER_L_MAX)
 		{ 
@@ -93,7 +131,7 @@ void Encoders::encA_rising()
         m_carriage = K;
       }
 
-      m_beltShift = digitalRead(ENC_PIN_C) ? Regular : Shifted;
+      m_beltShift = (*m_encC_port & m_encC_mask) ? Regular : Shifted;
       if (Regular == m_beltShift)
         { digitalWrite(LED_PIN_B, 1); }
       else if (Shifted == m_beltShift)
@@ -116,7 +154,7 @@ void Encoders::encA_falling()
          m_encoderPos--;
       }
 		
-      uint16 hallValue = analogRead(EOL_PIN_R);
+      uint16 hallValue = s_hallValue[1];
 		if( hallValue < FILTER_R_MIN || 
 			hallValue > FILTER_R_MAX)
 		{ 
@@ -125,7 +163,7 @@ void Encoders::encA_falling()
          m_carriage = K;
 
          // Belt shift signal only decided in front of hall sensor
-	      m_beltShift = digitalRead(ENC_PIN_C) ? Shifted : Regular;
+	      m_beltShift = (*m_encC_port & m_encC_mask) ? Shifted : Regular;
 
          // Known position of the carriage -> overwrite position
          m_encoderPos = END_RIGHT - 28;
@@ -134,44 +172,25 @@ void Encoders::encA_falling()
 }
 
 
-byte Encoders::getPosition()
-{
-	return m_encoderPos;
-}
-
-
-Beltshift_t Encoders::getBeltshift()
-{
-	return m_beltShift;
-}
-
-
-Direction_t Encoders::getDirection()
-{
-	return m_direction;
-}
-
-Direction_t Encoders::getHallActive()
-{
-   return m_hallActive;
-}
-
-Carriage_t Encoders::getCarriage()
-{
-  return m_carriage;
-}
-
 uint16 Encoders::getHallValue(Direction_t pSensor)
 {
+  byte _sensor;
+  uint16 _value;
   switch(pSensor)
   {
     case Left:
-      return analogRead(EOL_PIN_L);
+      _sensor = 0;
+      break;
     case Right:
-      return analogRead(EOL_PIN_R);
+      _sensor = 1;
+      break;
     default:
       return 0;
   }
+  noInterrupts(); // 16 bit value, updated by ADC interrupt
+  _value = s_hallValue[_sensor];
+  interrupts();
+  return _value;
 }
 /*
  * PRIVATE METHODS
@@ -25,17 +25,27 @@ This file is part of AYAB.
 #include "Arduino.h"
 #include "settings.h"
 
+/*!
+ *  Encoder and hall sensor evaluation
+ *
+ *  encA_interrupt() runs in the pin change ISR and must be fast:
+ *  encoder pins are read directly from their port registers, and the
+ *  hall sensors are converted continuously by the ADC in the background
+ *  (ADC interrupt), so only the latest values need to be looked up.
+ */
 class Encoders{
 public:
 	Encoders();
+  void init();
 
   void encA_interrupt();
 
-	byte 			getPosition();
-	Beltshift_t 	getBeltshift();
-	Direction_t 	getDirection();
-  Direction_t   getHallActive();
-  Carriage_t    getCarriage();
+	// inline, called from the ISR
+	byte 			getPosition()   { return m_encoderPos; }
+	Beltshift_t 	getBeltshift()  { return m_beltShift; }
+	Direction_t 	getDirection()  { return m_direction; }
+  Direction_t   getHallActive() { return m_hallActive; }
+  Carriage_t    getCarriage()   { return m_carriage; }
 
   uint16 getHallValue(Direction_t);
 
@@ -46,6 +56,14 @@ private:
   Carriage_t    m_carriage;
 	byte   m_encoderPos;
 
+  // direct access to the encoder pins
+  volatile uint8_t *m_encA_port;
+  volatile uint8_t *m_encB_port;
+  volatile uint8_t *m_encC_port;
+  uint8_t m_encA_mask;
+  uint8_t m_encB_mask;
+  uint8_t m_encC_mask;
+
   void encA_rising();
   void encA_falling();
 };
@@ -30,8 +30,13 @@ Knitter::Knitter()
 	m_stopNeedle        = 0;
 	m_currentLineNumber = 0;
 	m_lineRequested     = false;
+	m_knitSlot          = 0;
+	m_linesAhead        = 0;
+	m_needLine          = true;
+	m_prefetch          = false;
 
 	m_solenoids.init();
+	m_encoders.init();
 }
 
 void Knitter::isr()
@@ -47,6 +52,9 @@ void Knitter::isr()
 
 void Knitter::fsm()
 {
+	// acoustic feedback runs alongside, without blocking
+	m_beeper.schedule();
+
 	switch( m_opState ) {
 		case s_init:
 			state_init();
@@ -93,16 +101,34 @@ bool Knitter::startOperation(byte startNeedle,
 			m_lineRequested 	= false;
 			m_lastLineFlag		= false;
 			m_lastLinesCountdown= 2;
+			m_knitSlot			= 0;
+			m_linesAhead		= 0;
+			m_needLine			= true;
+			m_prefetch			= false;
 
 			m_beeper.ready();
 			
 			return true;			
 		}
+		else if( s_operate == m_opState )
+		{
+			// Reconfiguration of running operation:
+			// only the needle range changes, line counter, line buffers
+			// and encoder state are kept
+			m_startNeedle 		= startNeedle;
+			m_stopNeedle  		= stopNeedle;
+			return true;
+		}
 	}
 
 	return false;
 }
 
+bool Knitter::isOperating()
+{
+	return s_operate == m_opState;
+}
+
 bool Knitter::startTest()
 {
 	if (s_init == m_opState
@@ -114,22 +140,44 @@ bool Knitter::startTest()
 	return false;
 }
 
-bool Knitter::setNextLine(byte lineNumber)
-{
+byte *Knitter::setNextLine(byte lineNumber)
+{	// returns the buffer to store the line in, NULL if not accepted
 	if( m_lineRequested )
 	{	// Is there even a need for a new line?
 		if( lineNumber == m_currentLineNumber )
 		{
 			m_lineRequested = false;			
-			m_beeper.finishedLine();
-			return true;
+			if( m_needLine )
+			{	// carriage is waiting for it (or knits the old line again)
+				m_needLine = false;
+				m_beeper.finishedLine();
+				return m_lineBuffer + 25*m_knitSlot;
+			}
+			// received in advance
+			m_linesAhead++;
+			return m_lineBuffer + 25*((m_knitSlot+m_linesAhead) % LINE_BUFFER_COUNT);
 		}
 		else
 		{	// line numbers didnt match -> request again
 			reqLine(m_currentLineNumber);
 		}
 	}
-	return false;
+	return NULL;
+}
+
+
+void Knitter::setPrefetch(bool prefetch)
+{	// evaluated in s_operate
+	m_prefetch = prefetch;
+}
+
+
+void Knitter::repeatLineRequest()
+{	// line message was not usable -> request the same line again
+	if( m_lineRequested )
+	{
+		reqLine(m_currentLineNumber);
+	}
 }
 
 
@@ -200,6 +248,12 @@ void Knitter::state_operate()
 		reqLine(++m_currentLineNumber);
 	}
 
+	if( m_prefetch && !m_lineRequested && !m_lastLineFlag
+		&& !m_needLine && m_linesAhead < LINE_BUFFER_COUNT-1 )
+	{	// a buffer is free, request the next line ahead
+		reqLine(++m_currentLineNumber);
+	}
+
 #ifdef DBG_NOMACHINE
 	static bool _prevState = false;
 	bool state = digitalRead(DBG_BTN_PIN);
@@ -207,7 +261,7 @@ void Knitter::state_operate()
 	// TODO Check if debounce is needed
 	if( _prevState && !state )
 	{
-		if( !m_lineRequested )
+		if( !nextLine() && !m_lineRequested )
 		{
 			reqLine(++m_currentLineNumber);
 		}			
@@ -236,7 +290,7 @@ void Knitter::state_operate()
 			// Find the right byte from the currentLine array,
 			// then read the appropriate Pixel(/Bit) for the current needle to set
 			int _currentByte = (int)(m_pixelToSet/8);
-			bool _pixelValue = bitRead( m_lineBuffer[_currentByte], 
+			bool _pixelValue = bitRead( m_lineBuffer[25*m_knitSlot + _currentByte], 
 										m_pixelToSet-(8*_currentByte) );
 			// Write Pixel state to the appropriate needle
 			m_solenoids.setSolenoid( m_solenoidToSet, _pixelValue );
@@ -252,7 +306,10 @@ void Knitter::state_operate()
 			{	// already worked on the current line -> finished the line
 				_workedOnLine   = false;
 
-				if( !m_lineRequested && !m_lastLineFlag )
+				if( nextLine() )
+				{	// line received in advance, knit it right away
+				}
+				else if( !m_lineRequested && !m_lastLineFlag )
 				{	// request new Line from Host	
 					reqLine(++m_currentLineNumber);					
 				}
@@ -356,6 +413,20 @@ bool Knitter::calculatePixelAndSolenoid()
 }
 
 
+bool Knitter::nextLine()
+{	// current line is done, continue with the next one if already received
+	if( m_linesAhead > 0 )
+	{
+		m_knitSlot = (m_knitSlot+1) % LINE_BUFFER_COUNT;
+		m_linesAhead--;
+		m_beeper.finishedLine();
+		return true;
+	}
+	m_needLine = true;
+	return false;
+}
+
+
 void Knitter::reqLine( byte lineNumber )
 {	
 	Serial.write(reqLine_msgid);
@@ -41,7 +41,10 @@ public:
 						byte stopNeedle,
 						byte (*line));
     bool startTest(void);
-	bool setNextLine(byte lineNumber);
+	bool isOperating();
+	byte *setNextLine(byte lineNumber);
+	void setPrefetch(bool prefetch);
+	void repeatLineRequest();
 	void setLastLine();
 
 private:
@@ -58,7 +61,13 @@ private:
 	byte		m_stopNeedle;
 	bool		m_lineRequested;
 	byte 		m_currentLineNumber;
-	byte		(*m_lineBuffer);
+	byte		(*m_lineBuffer);	// LINE_BUFFER_COUNT lines of 25 bytes
+
+	// Line buffer ring
+	byte		m_knitSlot;		// buffer of the line being knitted
+	byte		m_linesAhead;	// lines received in advance
+	bool		m_needLine;		// line being knitted is done, next one not received yet
+	bool		m_prefetch;		// host allows requesting lines ahead
 
 	// current machine state
 	byte 		m_position;
@@ -78,6 +87,7 @@ private:
     void state_test();
 
 	bool calculatePixelAndSolenoid();
+	bool nextLine();
 
 	void reqLine( byte lineNumber );
     void indState( bool initState = false);
@@ -66,12 +66,14 @@ This file is part of AYAB.
 // DO NOT TOUCH
 #define FW_VERSION_MAJ 0
 #define FW_VERSION_MIN 90
-#define API_VERSION 4 // for message description, see below
+#define API_VERSION 5 // for message description, see below
 
 #define SERIAL_BAUDRATE 115200
 
 #define BEEPDELAY 50 // ms
 
+#define LINE_BUFFER_COUNT 4 // lines held in advance when the host allows prefetching (API v5)
+
 // Pin Assignments
 #define EOL_PIN_R 0	// Analog
 #define EOL_PIN_L 1	// Analog
@@ -113,6 +115,16 @@ typedef enum AYAB_API{
     debug_msgid       = 0xFF
 } AYAB_API_t;
 
+// cnfLine flags
+// - bit 0: last line of the pattern
+// - bit 1: (API v5) prefetch: host answers requests for lines ahead. Line
+//   requests are then sent as soon as a line buffer is free, up to
+//   LINE_BUFFER_COUNT-1 lines ahead of the line being knitted, so the
+//   next line is ready when the carriage turns around.
+//   Hosts not setting it get the API v4 behaviour (one line at a time).
+#define LINEFLAG_LASTLINE 0
+#define LINEFLAG_PREFETCH 1
+
 typedef enum Direction{
 	NoDirection	= 0,
 	Left  		= 1,
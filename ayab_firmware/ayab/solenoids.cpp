@@ -50,6 +50,8 @@ This file is part of AYAB.
 Solenoids::Solenoids()
 {
 	solenoidState = 0x00;
+	writtenState  = 0x00;
+	writtenValid  = false;
 }
 
 void Solenoids::init(void)
@@ -63,6 +65,8 @@ void Solenoids::init(void)
         mcp_0.pinMode(i, OUTPUT);
         mcp_1.pinMode(i, OUTPUT);
     }
+    // Wire.begin() (called by mcp.begin()) sets 100kHz, use fast mode
+    TWBR = ((F_CPU / I2C_CLOCK) - 16) / 2;
   #endif
   // No Action needed for SOFT_I2C
 }
@@ -79,7 +83,6 @@ void Solenoids::setSolenoid( byte solenoid, bool state )
 		{
 			bitClear(solenoidState,solenoid);
 		}	
-		// TODO optimize to act only when there is an actual change of state
 		write(solenoidState); 
 	}
 }
@@ -101,18 +104,37 @@ void Solenoids::setSolenoids( uint16 state )
  * Writes to the I2C port expanders
  * Low level function, mapping to actual wiring
  * is done here.
+ * Only the port expanders whose outputs change are written,
+ * so a single solenoid change is a single I2C transaction.
  */
 void Solenoids::write( uint16 newState )
 {
+  bool _writeLow  = !writtenValid || lowByte(newState)  != lowByte(writtenState);
+  bool _writeHigh = !writtenValid || highByte(newState) != highByte(writtenState);
+  writtenState = newState;
+  writtenValid = true;
+
   #ifdef HARD_I2C
-    mcp_0.writeGPIO(lowByte(newState));
-    mcp_1.writeGPIO(highByte(newState));
+    if( _writeLow )
+    {
+      mcp_0.writeGPIO(lowByte(newState));
+    }
+    if( _writeHigh )
+    {
+      mcp_1.writeGPIO(highByte(newState));
+    }
   #elif defined SOFT_I2C
-    Wire.beginTransmission( I2Caddr_sol1_8 | 0x20 );
-    Wire.send( lowByte(newState) );
-    Wire.endTransmission();
-    Wire.beginTransmission( I2Caddr_sol9_16 | 0x20);
-    Wire.send( highByte(newState) );
-    Wire.endTransmission(); 
+    if( _writeLow )
+    {
+      Wire.beginTransmission( I2Caddr_sol1_8 | 0x20 );
+      Wire.send( lowByte(newState) );
+      Wire.endTransmission();
+    }
+    if( _writeHigh )
+    {
+      Wire.beginTransmission( I2Caddr_sol9_16 | 0x20);
+      Wire.send( highByte(newState) );
+      Wire.endTransmission(); 
+    }
   #endif
 }
\ No newline at end of file
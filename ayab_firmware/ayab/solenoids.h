@@ -31,6 +31,8 @@ This file is part of AYAB.
 #define I2Caddr_sol1_8  0x0
 #define I2Caddr_sol9_16 0x1
 
+#define I2C_CLOCK 400000L // Hz, fast mode (hardware I2C only), MCP23008 supports up to 1.7MHz
+
 
 class Solenoids
 {
@@ -43,6 +45,8 @@ public:
 
 private:
    uint16 solenoidState;
+   uint16 writtenState;   // state last written to the port expanders
+   bool   writtenValid;   // false until both port expanders have been written
    void write( uint16 state );
 };
 
@@ -0,0 +1,101 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "alloccounter.hpp"
+
+#include <new>
+#include <stdlib.h>
+
+#if __cplusplus >= 201103L
+  #define ALLOC_THROWS
+  #define ALLOC_NOTHROW noexcept
+#else
+  #define ALLOC_THROWS throw(std::bad_alloc)
+  #define ALLOC_NOTHROW throw()
+#endif
+
+static __thread long threadAllocations = 0;
+
+
+long p44::threadAllocationCount()
+{
+  return threadAllocations;
+}
+
+
+static inline void *countedAlloc(std::size_t aSize)
+{
+  threadAllocations++;
+  return malloc(aSize ? aSize : 1);
+}
+
+
+void *operator new(std::size_t aSize) ALLOC_THROWS
+{
+  void *p = countedAlloc(aSize);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+
+void *operator new[](std::size_t aSize) ALLOC_THROWS
+{
+  void *p = countedAlloc(aSize);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+
+void *operator new(std::size_t aSize, const std::nothrow_t &) ALLOC_NOTHROW
+{
+  return countedAlloc(aSize);
+}
+
+
+void *operator new[](std::size_t aSize, const std::nothrow_t &) ALLOC_NOTHROW
+{
+  return countedAlloc(aSize);
+}
+
+
+void operator delete(void *aPtr) ALLOC_NOTHROW
+{
+  free(aPtr);
+}
+
+
+void operator delete[](void *aPtr) ALLOC_NOTHROW
+{
+  free(aPtr);
+}
+
+
+void operator delete(void *aPtr, const std::nothrow_t &) ALLOC_NOTHROW
+{
+  free(aPtr);
+}
+
+
+void operator delete[](void *aPtr, const std::nothrow_t &) ALLOC_NOTHROW
+{
+  free(aPtr);
+}
@@ -0,0 +1,36 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44ayabd__alloccounter__
+#define __p44ayabd__alloccounter__
+
+// Debug aid: global operator new/delete are replaced by versions that count the
+// allocations per thread, so code paths that must not allocate can be checked at runtime.
+
+namespace p44 {
+
+  /// @return number of heap allocations (via operator new) done by the calling thread so far
+  long threadAllocationCount();
+
+} // namespace p44
+
+#endif /* defined(__p44ayabd__alloccounter__) */
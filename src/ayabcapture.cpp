@@ -0,0 +1,134 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "ayabcapture.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using namespace p44;
+
+
+#pragma mark - AyabCaptureWriter
+
+AyabCaptureWriter::AyabCaptureWriter() :
+  fd(-1)
+{
+}
+
+
+AyabCaptureWriter::~AyabCaptureWriter()
+{
+  close();
+}
+
+
+bool AyabCaptureWriter::open(const char *aPath)
+{
+  close();
+  int f = ::open(aPath, O_WRONLY|O_APPEND|O_CREAT, 0644);
+  if (f<0) return false;
+  struct stat st;
+  if (fstat(f, &st)<0) {
+    int e = errno;
+    ::close(f);
+    errno = e;
+    return false;
+  }
+  if (st.st_size==0) {
+    // new file
+    if (write(f, AYAB_CAPTURE_MAGIC, AYAB_CAPTURE_MAGIC_BYTES)!=AYAB_CAPTURE_MAGIC_BYTES) {
+      int e = errno;
+      ::close(f);
+      errno = e;
+      return false;
+    }
+  }
+  fd = f;
+  return true;
+}
+
+
+void AyabCaptureWriter::close()
+{
+  if (fd>=0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+
+void AyabCaptureWriter::record(int64_t aTime, uint8_t aDirection, const uint8_t *aBytes, size_t aNumBytes)
+{
+  if (fd<0) return;
+  do {
+    size_t n = aNumBytes>AYAB_CAPTURE_MAX_DATA_BYTES ? AYAB_CAPTURE_MAX_DATA_BYTES : aNumBytes;
+    uint8_t rec[AYAB_CAPTURE_HEADER_BYTES+AYAB_CAPTURE_MAX_DATA_BYTES];
+    for (int i=0; i<8; i++) rec[i] = (uint64_t)aTime >> (8*i);
+    rec[8] = aDirection;
+    rec[9] = n & 0xFF;
+    rec[10] = n >> 8;
+    memcpy(rec+AYAB_CAPTURE_HEADER_BYTES, aBytes, n);
+    // single write, so records from different threads do not get mixed
+    // Note: capturing is a diagnostic aid, failing writes are ignored
+    ssize_t res = write(fd, rec, AYAB_CAPTURE_HEADER_BYTES+n);
+    (void)res;
+    aBytes += n;
+    aNumBytes -= n;
+  } while (aNumBytes>0);
+}
+
+
+#pragma mark - reading capture files
+
+bool p44::readAyabCapture(const char *aPath, AyabCaptureRecordVector &aRecords)
+{
+  FILE *f = fopen(aPath, "rb");
+  if (!f) return false;
+  char magic[AYAB_CAPTURE_MAGIC_BYTES];
+  if (fread(magic, 1, AYAB_CAPTURE_MAGIC_BYTES, f)!=AYAB_CAPTURE_MAGIC_BYTES || memcmp(magic, AYAB_CAPTURE_MAGIC, AYAB_CAPTURE_MAGIC_BYTES)!=0) {
+    fclose(f);
+    errno = EINVAL;
+    return false;
+  }
+  // Note: an incomplete last record (capturing process killed while writing) is ignored
+  uint8_t hdr[AYAB_CAPTURE_HEADER_BYTES];
+  while (fread(hdr, 1, AYAB_CAPTURE_HEADER_BYTES, f)==AYAB_CAPTURE_HEADER_BYTES) {
+    AyabCaptureRecord r;
+    uint64_t t = 0;
+    for (int i=0; i<8; i++) t |= (uint64_t)hdr[i] << (8*i);
+    r.time = (int64_t)t;
+    r.direction = hdr[8];
+    size_t n = hdr[9]+(hdr[10]<<8);
+    if (r.direction>AYAB_CAPTURE_TO_AYAB || n>AYAB_CAPTURE_MAX_DATA_BYTES) break; // corrupt
+    char buf[AYAB_CAPTURE_MAX_DATA_BYTES];
+    if (fread(buf, 1, n, f)!=n) break; // truncated
+    r.data.assign(buf, n);
+    aRecords.push_back(r);
+  }
+  fclose(f);
+  return true;
+}
@@ -0,0 +1,99 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44ayabd__ayabcapture__
+#define __p44ayabd__ayabcapture__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// Capture files of the serial traffic between p44ayabd and AYAB, for replaying sessions (see ayabreplay.cpp).
+// Format: AYAB_CAPTURE_MAGIC, followed by records, multi-byte values little endian:
+// - uint64 timestamp in microseconds (monotonic clock, origin arbitrary)
+// - uint8 direction (AYAB_CAPTURE_FROM_AYAB or AYAB_CAPTURE_TO_AYAB)
+// - uint16 number of data bytes
+// - data bytes: as read from the interface (from AYAB), or entire messages (to AYAB)
+// Note: no p44utils dependencies, so standalone tools can use it as well
+
+namespace p44 {
+
+  #define AYAB_CAPTURE_MAGIC "AYABCAP1"
+  #define AYAB_CAPTURE_MAGIC_BYTES 8
+  #define AYAB_CAPTURE_HEADER_BYTES 11 ///< bytes per record before the data bytes
+  #define AYAB_CAPTURE_MAX_DATA_BYTES 245 ///< longer data is split into multiple records
+  #define AYAB_CAPTURE_FROM_AYAB 0
+  #define AYAB_CAPTURE_TO_AYAB 1
+
+  /// appends records to a capture file
+  /// @note record() may be called from different threads concurrently, each record is written with a single write()
+  ///   to a file opened with O_APPEND.
+  class AyabCaptureWriter
+  {
+    int fd;
+
+  public:
+
+    AyabCaptureWriter();
+    ~AyabCaptureWriter();
+
+    /// open capture file for appending, create it (with magic) if it does not exist yet
+    /// @param aPath file path
+    /// @return false on failure (errno is set)
+    bool open(const char *aPath);
+
+    /// close capture file
+    void close();
+
+    /// @return true if capture file is open
+    bool isOpen() const { return fd>=0; };
+
+    /// append a record (no-op if not open)
+    /// @param aTime timestamp in microseconds
+    /// @param aDirection AYAB_CAPTURE_FROM_AYAB or AYAB_CAPTURE_TO_AYAB
+    /// @param aBytes the data
+    /// @param aNumBytes number of data bytes
+    void record(int64_t aTime, uint8_t aDirection, const uint8_t *aBytes, size_t aNumBytes);
+
+  };
+
+
+  /// one record of a capture file
+  typedef struct {
+    int64_t time; ///< timestamp in microseconds
+    uint8_t direction; ///< AYAB_CAPTURE_FROM_AYAB or AYAB_CAPTURE_TO_AYAB
+    std::string data; ///< data bytes
+  } AyabCaptureRecord;
+
+  typedef std::vector<AyabCaptureRecord> AyabCaptureRecordVector;
+
+  /// read an entire capture file
+  /// @param aPath file path
+  /// @param aRecords the records will be appended here
+  /// @return false on failure (errno is set, EINVAL for invalid file format)
+  bool readAyabCapture(const char *aPath, AyabCaptureRecordVector &aRecords);
+
+} // namespace p44
+
+#endif /* defined(__p44ayabd__ayabcapture__) */
@@ -21,17 +21,41 @@
 
 #include "ayabcomm.hpp"
 
+#include "alloccounter.hpp"
+
 #include "consolekey.hpp"
 #include "application.hpp"
 
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+
 using namespace p44;
 
 #define AYAB_COMMAPARMS "115200,8,N,1"
 
+#define AYAB_RESET_PULSE (100*MilliSecond) // DTR active time to reset the Arduino
+#define AYAB_BOOT_DELAY (250*MilliSecond) // min time for the bootloader after reset before polling
+#define AYAB_POLL_TIMEOUT (300*MilliSecond) // timeout for info requests while waiting for AYAB to respond after reset
+#define AYAB_RESTART_TIMEOUT (8*Second) // max time for AYAB to respond after reset
+#define AYAB_INFO_TIMEOUT (500*MilliSecond) // timeout for info confirmation (answered immediately)
+#define AYAB_START_TIMEOUT (1*Second) // timeout for start confirmation
+#define AYAB_CMD_RETRIES 2 // number of times a command is sent again when not confirmed in time
+#define AYAB_MAX_MESSAGE_BYTES 100 // longer debug texts are truncated
+#define AYAB_START_RETRY_INTERVAL (10*Second) // retry start when no ready indication arrives (in case it was missed)
+#define AYAB_RECONNECT_MIN_DELAY (500*MilliSecond) // delay before first attempt to reconnect after link loss
+#define AYAB_RECONNECT_MAX_DELAY (30*Second) // reconnect delay doubles with every failed attempt up to this
+#define AYAB_BENCHMARK_WINDOW (24*60*Minute) // benchmark latency statistics cover the entire run
+
+#define ALLOC_WARMUP_ROWS 16 // rows after start of job that may still allocate (lazy init of caches, buffers etc.)
+
 
 // AYAB serial protocol
-#define AYAB_EXPECTED_FIRMWARE 4 // current version per November 2017
-#define AYAB_SENDS_EXTRA_CRLF 1 // above version sends extra CRLF in confirm commands
+#define AYAB_MIN_FIRMWARE 4 // current version per November 2017
+#define AYAB_MAX_FIRMWARE 5 // v5: AYAB can request lines in advance, when line messages have the prefetch flag set
+// Note: above version sends extra CRLF after confirmations, parser just skips CR and LF between messages
 
 #define AYABCMD_DEBUG 0x23 // debug message from hardware
 
@@ -48,9 +72,31 @@ using namespace p44;
 #define AYABMSGID_STATE 4 // state (v4 only, from AYAB only)
 #define AYABMSGID_TEST 4 // test (v4 only, from HOST only)
 
+#define AYAB_LINEFLAG_LASTLINE 0x01 // no more lines
+#define AYAB_LINEFLAG_PREFETCH 0x02 // v5: host answers requests for lines in advance
+
+#define AYABMSG_TEXT -1 // text message up to CR/LF
+#define AYABMSG_UNKNOWN -2 // not a message start
+
+
+/// @return number of bytes following the message id byte for messages from AYAB,
+///   AYABMSG_TEXT for debug text, AYABMSG_UNKNOWN if not a known message id
+static int ayabMessageBodyBytes(uint8_t aMsgId)
+{
+  switch (aMsgId) {
+    case AYABCMD_DEBUG: return AYABMSG_TEXT; // # text CR LF
+    case AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_LINE: return 1; // line number
+    case AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_STATE: return 7; // ready, hall L, hall R, carriage, needle
+    case AYABCMD_FROM_AYAB|AYABCMD_CONFIRM|AYABMSGID_START: return 1; // success
+    case AYABCMD_FROM_AYAB|AYABCMD_CONFIRM|AYABMSGID_INFO: return 3; // API version, firmware major, minor
+    case AYABCMD_FROM_AYAB|AYABCMD_CONFIRM|AYABMSGID_TEST: return 1; // success
+    default: return AYABMSG_UNKNOWN;
+  }
+}
+
 #pragma mark - CRC8
 
-// taken from EnOcean ESP, assuming AYAB will use this once it actually checks CRC...
+// taken from EnOcean ESP, AYAB checks it and requests the line again on mismatch
 
 static u_int8_t CRC8Table[256] = {
   0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
@@ -98,69 +144,82 @@ static uint8_t crc8(uint8_t *aDataP, size_t aNumBytes, uint8_t aCRCValue)
 }
 
 
-#pragma mark - AyabRow
-
-AyabRow::AyabRow() :
-  rowSize(0),
-  rowData(NULL)
-{
-}
-
-
-AyabRow::~AyabRow()
-{
-  clear();
-}
-
-
-void AyabRow::clear()
-{
-  if (rowData!=NULL) {
-    delete [] rowData;
-    rowData = NULL;
-  }
-  rowSize = 0;
-}
-
-
-void AyabRow::setRowSize(size_t aRowSize)
-{
-  clear();
-  if (aRowSize>0) {
-    rowSize = aRowSize;
-    rowData = new bool[rowSize];
-  }
-}
-
-
-void AyabRow::setRowPixel(size_t aPixelNo, bool aValue)
-{
-  if (aPixelNo<rowSize) {
-    rowData[aPixelNo] = aValue;
-  }
-}
-
-
-
-
 #pragma mark - AyabComm
 
 AyabComm::AyabComm(MainLoop &aMainLoop) :
 	inherited(aMainLoop),
   simulated(false),
   fullspeedsim(false),
+  benchmark(false),
+  benchmarkLatency(AYAB_BENCHMARK_WINDOW),
   firstNeedle(0),
   width(0),
   rowCallBack(NULL),
   rowCount(0),
   nextRequestRow(0),
+  lookahead(0),
+  ringHead(0),
+  ringCount(0),
+  fillTicket(0),
+  rowAllocsLast(0),
+  rowAllocsTotal(0),
+  rowsWithAllocs(0),
+  serialThreadPriority(0),
+  serialFd(-1),
+  serialThreadStop(false),
+  ringGeneration(0),
+  eventOverflows(0),
+  ringProduced(0),
+  ringEndQueued(false),
+  ringPurgePending(false),
+  restartTicket(0),
+  startTicket(0),
+  waitingForReady(false),
+  restarts(0),
+  linkDown(false),
+  serialThreadWanted(false),
+  reconnectTicket(0),
+  resumeKnitting(false),
+  resuming(false),
+  resumeProbePending(false),
+  resendPending(false),
+  lastFrameValid(false),
+  apiVersion(0),
+  linePrefetch(true),
+  repeatedRows(0),
+  reconnects(0),
+  reconnectAttempts(0),
+  commandSerial(0),
   status(ayabstatus_offline)
 {
+  lineRequestTime = Never;
+  responseQueuedTime = Never;
+  responseWrittenTime = Never;
+  threadWakePipe[0] = -1; threadWakePipe[1] = -1;
+  mainWakePipe[0] = -1; mainWakePipe[1] = -1;
+  restartTime = Never;
+  jobStartTime = Never;
+  lastResetToResponse = Never;
+  lastRestartToKnitting = Never;
+  lastJobToKnitting = Never;
+  reconnectDelay = AYAB_RECONNECT_MIN_DELAY;
+  linkLostTime = Never;
+  reconnectedTime = Never;
+  lastOutage = Never;
+  totalOutage = 0;
+  benchmarkStart = Never;
+  benchmarkEnd = Never;
 }
 
 
 AyabComm::~AyabComm()
 {
+  stopSerialThread();
+  MainLoop::currentMainLoop().cancelExecutionTicket(fillTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(restartTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(startTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(reconnectTicket);
+  abortCommands();
 }
 
 
@@ -177,14 +236,67 @@ void AyabComm::setConnectionSpecification(const char *aConnectionSpec, uint16_t
   }
   else {
     serialComm->setConnectionSpecification(aConnectionSpec, aDefaultPort, AYAB_COMMAPARMS);
+    // set accept buffer for re-assembling messages before processing
+    setAcceptBuffer(AYAB_MAX_MESSAGE_BYTES); // for re-assembling messages, largest binary message is 8 bytes, texts can be longer
     // open connection so we can receive
     if (serialComm->requestConnection()) {
       status = ayabstatus_connected;
       serialComm->setDTR(false); // arduino reset
+      monitorLink();
     }
-    // set accept buffer for re-assembling messages before processing
-    setAcceptBuffer(20); // largest message is 10 bytes (8 + possibly CRLF)
+    else {
+      // keep trying
+      LOG(LOG_ERR, "Cannot open connection to AYAB - retrying in %lld mS", reconnectDelay/MilliSecond);
+      linkDown = true;
+      reconnectTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::reconnect, this), reconnectDelay);
+    }
+  }
+}
+
+
+void AyabComm::setBenchmarkMode(SimpleCB aDoneCB)
+{
+  simulated = true;
+  benchmark = true;
+  benchmarkDoneCB = aDoneCB;
+  LOG(LOG_NOTICE, "BENCHMARK MODE: knitting jobs are run without AYAB as fast as possible");
+  status = ayabstatus_connected;
+}
+
+
+void AyabComm::benchmarkRequest()
+{
+  // simulate a line request from AYAB
+  lineRequestTime = MainLoop::now();
+  sendNextRow();
+}
+
+
+JsonObjectPtr AyabComm::benchmarkStatsJSON()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  MLMicroSeconds duration = benchmarkStart!=Never && benchmarkEnd!=Never ? benchmarkEnd-benchmarkStart : 0;
+  s->add("rows", JsonObject::newInt64(benchmarkLatency.count()));
+  s->add("seconds", JsonObject::newDouble((double)duration/Second));
+  s->add("rowsPerSecond", JsonObject::newDouble(duration>0 ? (double)benchmarkLatency.count()*Second/duration : 0));
+  s->add("fromLookahead", JsonObject::newInt64(rowLatency[0].count()));
+  s->add("renderedOnRequest", JsonObject::newInt64(rowLatency[1].count()));
+  JsonObjectPtr l = benchmarkLatency.statsJSON();
+  l->add("p999US", JsonObject::newInt64(benchmarkLatency.percentile(99.9)));
+  s->add("rowLatency", l);
+  s->add("rowsWithAllocs", JsonObject::newInt64(rowsWithAllocs));
+  s->add("repeatedRows", JsonObject::newInt64(repeatedRows));
+  return s;
+}
+
+
+ErrorPtr AyabComm::setCaptureFile(const char *aPath)
+{
+  if (!capture.open(aPath)) {
+    return SysError::errNo("cannot open capture file: ");
   }
+  LOG(LOG_NOTICE, "Capturing serial traffic to %s", aPath);
+  return ErrorPtr();
 }
 
 
@@ -210,80 +322,171 @@ bool AyabComm::simulationControlKeyHandler(char aKey)
 
 
 
-void AyabComm::sendCommand(size_t aCmdLength, uint8_t *aCmdBytesP, StatusCB aStatusCB)
+void AyabComm::sendCommand(size_t aCmdLength, uint8_t *aCmdBytesP, StatusCB aStatusCB, MLMicroSeconds aTimeout, int aRetries)
 {
   if (simulated) {
     LOG(LOG_DEBUG,"Simulated sending of Command to AYAB, %lu bytes", aCmdLength+1);
     aStatusCB(ErrorPtr());
     return;
   }
-  SerialOperationSendPtr sendOp = SerialOperationSendPtr(new SerialOperationSend);
-  sendOp->setDataSize(aCmdLength);
-  sendOp->appendData(aCmdLength, aCmdBytesP);
-  // prepare response reading operation
-  SerialOperationReceivePtr recOp = SerialOperationReceivePtr(new SerialOperationReceive);
-  #if AYAB_SENDS_EXTRA_CRLF
-  recOp->setExpectedBytes(4); // expected 4 response bytes
-  #else
-  recOp->setExpectedBytes(2); // expected 2 response bytes
-  #endif
-  recOp->inSequence = true;
-  recOp->setTimeout(20*Second); // large timeout, because it can really take time until all expected answers are received
-  recOp->setCompletionCallback(boost::bind(&AyabComm::ayabCmdResponseHandler, this, aStatusCB, recOp, _1));
-  // chain response op
-  sendOp->setChainedOperation(recOp);
-  queueSerialOperation(sendOp);
-  // process operations
-  processOperations();
+  PendingCommand cmd;
+  cmd.serial = ++commandSerial;
+  cmd.len = aCmdLength>AYAB_MAX_COMMAND_BYTES ? AYAB_MAX_COMMAND_BYTES : aCmdLength;
+  memcpy(cmd.bytes, aCmdBytesP, cmd.len);
+  cmd.timeout = aTimeout;
+  cmd.retries = aRetries;
+  cmd.timeoutTicket = 0;
+  cmd.confirmCB = aStatusCB;
+  pendingCommands.push_back(cmd);
+  transmitCommand(pendingCommands.back());
+}
+
+
+void AyabComm::transmitCommand(PendingCommand &aCmd)
+{
+  // Note: commands are short, and confirmations are matched by message id, so commands can be sent
+  //   at any time, even while line requests are being processed
+  if (linkDown) return; // will be sent after reconnecting
+  ErrorPtr err;
+  if (serialThread) {
+    // serial thread is the only writer while it runs
+    if (!threadTransmit(aCmd.len, aCmd.bytes)) {
+      LOG(LOG_ERR, "Serial I/O thread write queue full, command 0x%02X not sent", aCmd.bytes[0]);
+      // Note: timeout still applies, so the command is retried
+    }
+  }
+  else {
+    capture.record(MainLoop::now(), AYAB_CAPTURE_TO_AYAB, aCmd.bytes, aCmd.len);
+    serialComm->transmitBytes(aCmd.len, aCmd.bytes, err);
+  }
+  if (!Error::isOK(err)) {
+    LOG(LOG_ERR, "Error sending command 0x%02X to AYAB: %s", aCmd.bytes[0], err->description().c_str());
+    connectionLost(err); // command will be sent again after reconnecting
+    return;
+  }
+  aCmd.timeoutTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::commandTimeout, this, aCmd.serial), aCmd.timeout);
+}
+
+
+void AyabComm::commandTimeout(unsigned aSerial)
+{
+  for (PendingCommandList::iterator pos = pendingCommands.begin(); pos!=pendingCommands.end(); ++pos) {
+    if (pos->serial==aSerial) {
+      pos->timeoutTicket = 0;
+      if (pos->retries>0) {
+        pos->retries--;
+        LOG(LOG_WARNING, "AYAB did not confirm command 0x%02X within %lld mS - sending again", pos->bytes[0], pos->timeout/MilliSecond);
+        transmitCommand(*pos);
+        return;
+      }
+      StatusCB cb = pos->confirmCB;
+      uint8_t cmdId = pos->bytes[0];
+      pendingCommands.erase(pos);
+      if (cb) cb(TextError::err("AYAB did not confirm command 0x%02X", cmdId));
+      return;
+    }
+  }
+}
+
+
+void AyabComm::abortCommands()
+{
+  for (PendingCommandList::iterator pos = pendingCommands.begin(); pos!=pendingCommands.end(); ++pos) {
+    MainLoop::currentMainLoop().cancelExecutionTicket(pos->timeoutTicket);
+  }
+  if (!pendingCommands.empty()) {
+    LOG(LOG_INFO, "%zu pending AYAB command(s) dropped", pendingCommands.size());
+  }
+  pendingCommands.clear();
 }
 
 
 void AyabComm::sendResponse(size_t aRespLength, uint8_t *aRespBytesP)
 {
+  responseQueuedTime = MainLoop::now();
+  responseWrittenTime = responseQueuedTime;
   if (simulated) {
     LOG(LOG_DEBUG,"Simulated sending of response to AYAB, %lu bytes", aRespLength+1);
     return;
   }
-  SerialOperationSendPtr sendOp = SerialOperationSendPtr(new SerialOperationSend);
-  sendOp->setDataSize(aRespLength);
-  sendOp->appendData(aRespLength, aRespBytesP);
-  queueSerialOperation(sendOp);
-  // process operations
-  processOperations();
+  if (linkDown) return; // last line message will be sent again after reconnecting
+  if (serialThread) {
+    // serial thread is the only writer while it runs
+    if (!threadTransmit(aRespLength, aRespBytesP)) {
+      LOG(LOG_ERR, "Serial I/O thread write queue full, response not sent");
+    }
+    return;
+  }
+  // responses are time critical and need no answer: transmit directly, without allocating a send operation
+  ErrorPtr err;
+  capture.record(responseQueuedTime, AYAB_CAPTURE_TO_AYAB, aRespBytesP, aRespLength);
+  size_t sent = serialComm->transmitBytes(aRespLength, aRespBytesP, err);
+  // Note: when not all bytes could be written at once, this is the time the rest gets queued
+  responseWrittenTime = MainLoop::now();
+  if (!Error::isOK(err)) {
+    LOG(LOG_ERR, "Error sending response to AYAB: %s", err->description().c_str());
+    connectionLost(err);
+    return;
+  }
+  if (sent<aRespLength) {
+    // could not send all at once, let the queue send the rest
+    SerialOperationSendPtr sendOp = SerialOperationSendPtr(new SerialOperationSend);
+    sendOp->setDataSize(aRespLength-sent);
+    sendOp->appendData(aRespLength-sent, aRespBytesP+sent);
+    queueSerialOperation(sendOp);
+    // process operations
+    processOperations();
+  }
 }
 
 
 
 
-void AyabComm::ayabCmdResponseHandler(StatusCB aStatusCB, SerialOperationReceivePtr aRecOp, ErrorPtr aError)
+bool AyabComm::confirmReceived(const uint8_t *aMsg)
 {
-  // get received data
-  if (!aError && aRecOp->getDataSize()>=2) {
-    uint8_t resp = aRecOp->getDataP()[0];
-    if (resp==(AYABCMD_FROM_AYAB|AYABCMD_CONFIRM|AYABMSGID_INFO)) {
-      // params: 0xaa 0xbb 0xcc - aa = API Version Identifier, bb = Firmware Major Version, cc = Firmware Minor Version
-      uint8_t ver = aRecOp->getDataP()[1];
-      uint8_t maj = aRecOp->getDataP()[2];
-      uint8_t min = aRecOp->getDataP()[3];
-      LOG(LOG_INFO, "AYAB API version: %d, Firmware Version %d.%d", ver, maj, min);
-      if (ver!=AYAB_EXPECTED_FIRMWARE) {
-        aError = TextError::err("AYAB reports firmware version %d, but we expect version %d", ver, AYAB_EXPECTED_FIRMWARE);
-      }
-    }
-    else if (resp==(AYABCMD_FROM_AYAB|AYABCMD_CONFIRM|AYABMSGID_START)) {
-      uint8_t sta = aRecOp->getDataP()[1];
-      LOG(LOG_INFO, "AYAB start status: %d", sta);
-      if (sta!=1) {
-        aError = TextError::err("AYAB start command failed, AYAB status code = %d", sta);
-      }
+  // confirmation matches oldest pending command with same message id
+  uint8_t msgId = aMsg[0] & AYABCMD_MSGID_MASK;
+  PendingCommandList::iterator pos;
+  for (pos = pendingCommands.begin(); pos!=pendingCommands.end(); ++pos) {
+    if ((pos->bytes[0] & AYABCMD_MSGID_MASK)==msgId) break;
+  }
+  if (pos==pendingCommands.end()) return false; // no command waiting for this
+  MainLoop::currentMainLoop().cancelExecutionTicket(pos->timeoutTicket);
+  StatusCB cb = pos->confirmCB;
+  pendingCommands.erase(pos);
+  // evaluate
+  ErrorPtr err;
+  if (msgId==AYABMSGID_INFO) {
+    // params: 0xaa 0xbb 0xcc - aa = API Version Identifier, bb = Firmware Major Version, cc = Firmware Minor Version
+    uint8_t ver = aMsg[1];
+    uint8_t maj = aMsg[2];
+    uint8_t min = aMsg[3];
+    LOG(LOG_INFO, "AYAB API version: %d, Firmware Version %d.%d", ver, maj, min);
+    if (ver<AYAB_MIN_FIRMWARE || ver>AYAB_MAX_FIRMWARE) {
+      err = TextError::err("AYAB reports firmware version %d, but we expect version %d..%d", ver, AYAB_MIN_FIRMWARE, AYAB_MAX_FIRMWARE);
     }
     else {
-      aError = TextError::err("AYAB invalid response for command: 0x%02X", resp);
+      if (ver!=apiVersion && ver>=5) LOG(LOG_NOTICE, "AYAB can request lines in advance (API version %d)%s", ver, linePrefetch ? "" : ", but prefetching is disabled");
+      apiVersion = ver;
+    }
+  }
+  else if (msgId==AYABMSGID_START) {
+    uint8_t sta = aMsg[1];
+    LOG(LOG_INFO, "AYAB start status: %d", sta);
+    if (sta==0) {
+      err = ErrorPtr(new AyabCommError(AyabCommError::NotReady, "AYAB not ready to start knitting"));
+    }
+    else if (sta!=1) {
+      err = TextError::err("AYAB start command failed, AYAB status code = %d", sta);
     }
   }
-  if (aStatusCB) {
-    aStatusCB(aError);
+  else if (msgId==AYABMSGID_TEST) {
+    if (aMsg[1]!=1) {
+      err = TextError::err("AYAB test command failed, AYAB status code = %d", aMsg[1]);
+    }
   }
+  if (cb) cb(err);
+  return true;
 }
 
 
@@ -291,161 +494,1219 @@ void AyabComm::ayabCmdResponseHandler(StatusCB aStatusCB, SerialOperationReceive
 
 ssize_t AyabComm::acceptExtraBytes(size_t aNumBytes, uint8_t *aBytes)
 {
-  // got bytes without having sent command before: must be Line request or state indication
-  if (aBytes[0]=='#') {
-    // Debug comment text line: text terminated by \r\n
-    int idx=1;
-    while (idx<aNumBytes-1) {
-      if (aBytes[idx]=='\r') {
-        string msg((char *)(aBytes+1), idx-1);
-        LOG(LOG_INFO, "Debug message from AYAB: %s", msg.c_str());
-        return idx+2; // including # and CRLF
-      }
-      idx++;
-    }
-    return NOT_ENOUGH_BYTES;
+  // all bytes from AYAB arrive here: frame messages
+  if (aBytes[0]==0x0D || aBytes[0]==0x0A) {
+    return 1; // CR or LF following a message, skip
+  }
+  int bodyBytes = ayabMessageBodyBytes(aBytes[0]);
+  size_t msgLen;
+  if (bodyBytes==AYABMSG_UNKNOWN) {
+    // skip byte to re-sync
+    LOG(LOG_DEBUG, "unknown byte 0x%02X from AYAB discarded", aBytes[0]);
+    return 1;
   }
-  if (aBytes[0]==(AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_LINE)) {
-    // must be 2 bytes at least
-    if (aNumBytes<2) {
+  else if (bodyBytes==AYABMSG_TEXT) {
+    // text terminated by CR or LF
+    msgLen = 1;
+    while (msgLen<aNumBytes && aBytes[msgLen]!=0x0D && aBytes[msgLen]!=0x0A) msgLen++;
+    if (msgLen>=aNumBytes && aNumBytes<AYAB_MAX_MESSAGE_BYTES) {
       return NOT_ENOUGH_BYTES;
     }
-    // AYAB requests next line
-    // params: 0xaa - aa = line number (Range: 0..255)
-    LOG(LOG_INFO, "AYAB requests data for row #%d (overall count %d)", nextRequestRow, rowCount);
-    uint8_t rowNo = aBytes[1];
-    size_t consumed = 2;
-    // swallow possible extra CRLF
-    while (consumed<aNumBytes) {
-      if (aBytes[consumed]!=0x0A && aBytes[consumed]!=0x0D) break; // not CR or LF, probably real data
-      consumed++;
-    }
-    // process row request
-    if (rowNo!=nextRequestRow) {
-      LOG(LOG_ERR, "AYAB requests line #%d, we would have expected #%d", rowNo, nextRequestRow);
-      nextRequestRow = rowNo;
-    }
-    // obtain and send next row
-    sendNextRow();
-    // the 2 request bytes are consumed
-    return consumed;
   }
-  else if (aBytes[0]==(AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_STATE)) {
-    if (aNumBytes<8) {
+  else {
+    msgLen = 1+bodyBytes;
+    if (aNumBytes<msgLen) {
       return NOT_ENOUGH_BYTES;
     }
-    // 0x0a 0xBB 0xbb 0xCC 0xcc 0xdd 0xee
-    // - a = ready (0 = false, 1 = true)
-    // - BBbb = int left hall sensor value
-    // - CCcc = int right hall sensor value
-    // - dd = the carriage
-    //   0 = no carriage detected
-    //   1 = knit carriage “Strickschlitten”
-    //   2 = hole carriage “Lochmusterschlitten”
-    // - ee = the needle number currently in progress
-    LOG(LOG_NOTICE,
-      "AYAB indicates state:\n"
-      "- ready: %d\n"
-      "- left hall sensor: %d\n"
-      "- right hall sensor: %d\n"
-      "- carriage: %s\n"
-      "- needle number in progress: %d",
-      aBytes[1],
-      (aBytes[2]<<8)+aBytes[3],
-      (aBytes[4]<<8)+aBytes[5],
-      aBytes[6]==0 ? "<none>" : (aBytes[6]==1 ? "Knit" : "Hole"),
-      aBytes[7]
-    );
-    return 8; // consumed all
-  }
-  // consume all other data to re-sync
-  LOG(LOG_DEBUG, "%zu extra bytes from AYAB discarded", aNumBytes);
-  return (ssize_t)aNumBytes;
+  }
+  processMessage(aBytes, msgLen);
+  return (ssize_t)msgLen;
 }
 
 
-void AyabComm::sendNextRow()
+void AyabComm::processMessage(const uint8_t *aMsg, size_t aMsgLen)
 {
-  // call back to get row data
-  AyabRowPtr row;
-  if (rowCallBack) {
-    row = rowCallBack(rowCount, ErrorPtr());
-    rowCount++;
-  }
-  // send data or stop
-  status = ayabstatus_knitting;
-  // 0xaa 0xbb[24, 23, 22, ... 1, 0] 0xcc 0xdd
-  // - aa = line number (Range: 0..255)
-  // - bb[24 to 0] = binary pixel data
-  // - cc = flags (bit 0: lastLine)
-  // - dd = CRC8 Checksum
-  const int rowresponselen = 29;
-  uint8_t rowresponse[rowresponselen];
-  memset(rowresponse,0,rowresponselen); // init to default
-  rowresponse[0] = AYABCMD_CONFIRM|AYABCMD_FROM_HOST|AYABMSGID_LINE;
-  rowresponse[1] = nextRequestRow; // answer for requested row
-  if (row) {
-    // we got a row to knit, fill in bits
-    if (LOGENABLED(LOG_NOTICE)) {
-      string rs;
-      for (int i=0; i<row->rowSize; i++) {
-        rs += row->rowData[i] ? 'X' : '.';
+  switch (aMsg[0]) {
+    case AYABCMD_DEBUG: {
+      // Debug comment text line
+      string msg((const char *)(aMsg+1), aMsgLen-1);
+      LOG(LOG_INFO, "Debug message from AYAB: %s", msg.c_str());
+      break;
+    }
+    case AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_LINE: {
+      // AYAB requests next line
+      lineRequestTime = MainLoop::now();
+      // params: 0xaa - aa = line number (Range: 0..255)
+      LOG(LOG_INFO, "AYAB requests data for row #%d (overall count %d)", nextRequestRow, rowCount);
+      uint8_t rowNo = aMsg[1];
+      if (resendPending) {
+        // first request after resuming the job
+        resendPending = false;
+        if (rowNo!=nextRequestRow) {
+          // AYAB has restarted its line numbering, i.e. it was reset while disconnected. The row it was
+          // working on must be knitted again. It has already been taken from the row source, so just send it again
+          // Note: with line prefetch, rows AYAB had received in advance are lost (up to 3 with the current firmware)
+          LOG(LOG_WARNING, "AYAB requests line #%d after resuming, expected #%d - sending row %d again", rowNo, nextRequestRow, rowCount);
+          lineRequestTime = Never;
+          nextRequestRow = rowNo+1;
+          resendLastFrame(rowNo);
+        }
+        else {
+          // AYAB has kept its line counter, just continue
+          sendNextRow();
+        }
+        // line requests can be served by the serial thread again
+        if (serialThreadWanted) startSerialThread(serialThreadPriority);
+        break;
+      }
+      if (lastFrameValid && rowNo==lastFrame[1]) {
+        // AYAB requests the row just sent again (line message corrupted or lost): do not advance the row source
+        LOG(LOG_WARNING, "AYAB requests line #%d again - sending row %d again", rowNo, rowCount);
+        lineRequestTime = Never;
+        repeatedRows++;
+        resendLastFrame(rowNo);
+        break;
       }
-      LOG(LOG_NOTICE,"Row No. %4d : %s", rowCount, rs.c_str());
+      // process row request
+      if (rowNo!=nextRequestRow) {
+        LOG(LOG_ERR, "AYAB requests line #%d, we would have expected #%d", rowNo, nextRequestRow);
+        nextRequestRow = rowNo;
+      }
+      // obtain and send next row
+      sendNextRow();
+      break;
     }
-    // MSByte contains the first needle in bit0, the eigth needle in bit7, the ninth needle is bit0 in second byte, etc.
-    for (int i=0; i<row->rowSize; i++) {
-      // inverse direction
-      if (row->rowData[row->rowSize-1-i]) {
-        int j = i+firstNeedle;
-        rowresponse[2+(j>>3)] |= (0x01 << (j & 0x07));
+    case AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_STATE: {
+      // 0x0a 0xBB 0xbb 0xCC 0xcc 0xdd 0xee
+      // - a = ready (0 = false, 1 = true)
+      // - BBbb = int left hall sensor value
+      // - CCcc = int right hall sensor value
+      // - dd = the carriage
+      //   0 = no carriage detected
+      //   1 = knit carriage “Strickschlitten”
+      //   2 = hole carriage “Lochmusterschlitten”
+      // - ee = the needle number currently in progress
+      LOG(LOG_NOTICE,
+        "AYAB indicates state:\n"
+        "- ready: %d\n"
+        "- left hall sensor: %d\n"
+        "- right hall sensor: %d\n"
+        "- carriage: %s\n"
+        "- needle number in progress: %d",
+        aMsg[1],
+        (aMsg[2]<<8)+aMsg[3],
+        (aMsg[4]<<8)+aMsg[5],
+        aMsg[6]==0 ? "<none>" : (aMsg[6]==1 ? "Knit" : "Hole"),
+        aMsg[7]
+      );
+      if (aMsg[1] && waitingForReady) {
+        // machine became ready, now start can succeed
+        waitingForReady = false;
+        MainLoop::currentMainLoop().cancelExecutionTicket(startTicket);
+        startTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::sendStart, this));
       }
+      break;
     }
+    default:
+      // confirmations
+      if (!confirmReceived(aMsg)) {
+        LOG(LOG_INFO, "AYAB sent confirmation 0x%02X without pending command - ignored", aMsg[0]);
+      }
+      break;
+  }
+}
+
+
+void AyabComm::sendNextRow()
+{
+  long allocsBefore = threadAllocationCount();
+  MLMicroSeconds requestTime = lineRequestTime!=Never ? lineRequestTime : MainLoop::now();
+  lineRequestTime = Never;
+  MLMicroSeconds callbackStart = MainLoop::now();
+  uint8_t rowresponse[AYAB_LINE_FRAME_BYTES];
+  uint8_t *frame;
+  bool fromRing = ringCount>0;
+  if (fromRing) {
+    // row is ready, just take it from the ring
+    frame = ringFrames[ringHead];
+    ringHead = (ringHead+1) % AYAB_MAX_LOOKAHEAD;
+    ringCount--;
+    if (frame[1]!=nextRequestRow) {
+      // request for another row number than expected when rendering
+      frame[1] = nextRequestRow;
+      frame[AYAB_LINE_FRAME_BYTES-1] = crc8(frame, AYAB_LINE_FRAME_BYTES-1, 0);
+    }
+    // let row source advance to the row just sent
+    if (rowAdvanceCallBack) rowAdvanceCallBack();
+  }
+  else {
+    // call back to get row data
+    AyabRow row;
+    if (rowCallBack) {
+      rowCallBack(rowCount, ErrorPtr(), row);
+    }
+    else {
+      row.endOfJob = true;
+    }
+    buildFrame(row, nextRequestRow, rowresponse);
+    frame = rowresponse;
+  }
+  MLMicroSeconds callbackEnd = MainLoop::now();
+  if (rowCallBack) rowCount++;
+  memcpy(lastFrame, frame, AYAB_LINE_FRAME_BYTES);
+  lastFrameValid = true;
+  // send data or stop
+  status = ayabstatus_knitting;
+  bool lastLine = frame[AYAB_LINE_FRAME_BYTES-2] & AYAB_LINEFLAG_LASTLINE;
+  if (!lastLine) {
+    logRow(frame+2);
     // next
     nextRequestRow++;
   }
   else {
     LOG(LOG_NOTICE, "--- End of knitting job - total row count %d", rowCount);
     fullspeedsim = false; // end full speed simulation at end of job
-    // no more rows, send empty one with lastline flag set
-    rowresponse[rowresponselen-2] = 1; // lastline
     // back to ready
     status = ayabstatus_ready;
   }
-  // calculate CRC8
-  // TODO: once AYAB actually checks CRC, we might need to adjust range of checked bytes and start value here
-  rowresponse[rowresponselen-1] = crc8(rowresponse, rowresponselen-1, 0); // for now: %%% CRC over entire message and start value 0
   // send it now
-  sendResponse(rowresponselen, rowresponse);
+  sendResponse(AYAB_LINE_FRAME_BYTES, frame);
+  // statistics
+  MLMicroSeconds now = responseWrittenTime;
+  stageLatency[stage_dispatch].add(callbackStart-requestTime, now);
+  stageLatency[stage_callback].add(callbackEnd-callbackStart, now);
+  stageLatency[stage_frame].add(responseQueuedTime-callbackEnd, now);
+  stageLatency[stage_write].add(responseWrittenTime-responseQueuedTime, now);
+  stageLatency[stage_total].add(responseWrittenTime-requestTime, now);
+  if (benchmark) benchmarkLatency.add(responseWrittenTime-requestTime, now);
+  rowLatency[fromRing ? 0 : 1].add(responseWrittenTime-requestTime, now);
+  // row is on its way now, render next rows
+  if (!lastLine) {
+    fillLookahead();
+  }
+  accountRowAllocs(allocsBefore);
   // in simulated full speed, just call again
   if (simulated && fullspeedsim) {
     MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::sendNextRow, this), 10*MilliSecond);
   }
+  else if (benchmark) {
+    if (lastLine) {
+      benchmarkEnd = MainLoop::now();
+      if (benchmarkDoneCB) benchmarkDoneCB();
+    }
+    else {
+      // like AYAB, request the next row only after this one has been sent
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::benchmarkRequest, this));
+    }
+  }
+}
+
+
+void AyabComm::accountRowAllocs(long aAllocsBefore)
+{
+  rowAllocsLast = threadAllocationCount()-aAllocsBefore;
+  if (rowCount>ALLOC_WARMUP_ROWS) {
+    rowAllocsTotal += rowAllocsLast;
+    if (rowAllocsLast>0) rowsWithAllocs++;
+  }
+}
+
+
+void AyabComm::logRow(const uint8_t *aNeedles)
+{
+  if (LOGENABLED(LOG_INFO)) {
+    char rs[AYAB_NEEDLE_BYTES*8+1];
+    for (int i=0; i<width; i++) {
+      int j = firstNeedle+width-1-i; // inverse direction
+      rs[i] = aNeedles[j>>3] & (0x01 << (j & 0x07)) ? 'X' : '.';
+    }
+    rs[width] = 0;
+    LOG(LOG_INFO,"Row No. %4d : %s", rowCount, rs);
+  }
+}
+
+
+void AyabComm::buildFrame(const AyabRow &aRow, uint8_t aRowNo, uint8_t *aFrame)
+{
+  // 0xaa 0xbb[24, 23, 22, ... 1, 0] 0xcc 0xdd
+  // - aa = line number (Range: 0..255)
+  // - bb[24 to 0] = binary pixel data
+  // - cc = flags (bit 0: lastLine, bit 1: prefetch (v5))
+  // - dd = CRC8 Checksum
+  aFrame[0] = AYABCMD_CONFIRM|AYABCMD_FROM_HOST|AYABMSGID_LINE;
+  aFrame[1] = aRowNo; // answer for requested row
+  if (!aRow.endOfJob) {
+    // MSByte contains the first needle in bit0, the eigth needle in bit7, the ninth needle is bit0 in second byte, etc.
+    aRow.needles.getBytes(aFrame+2, AYAB_NEEDLE_BYTES);
+  }
+  else {
+    // no more rows, send empty one with lastline flag set
+    memset(aFrame+2, 0, AYAB_NEEDLE_BYTES);
+  }
+  aFrame[AYAB_LINE_FRAME_BYTES-2] = lineFlags(aRow.endOfJob);
+  // calculate CRC8 over entire message, start value 0 (AYAB checks it)
+  aFrame[AYAB_LINE_FRAME_BYTES-1] = crc8(aFrame, AYAB_LINE_FRAME_BYTES-1, 0);
+}
+
+
+uint8_t AyabComm::lineFlags(bool aLastLine)
+{
+  uint8_t flags = aLastLine ? AYAB_LINEFLAG_LASTLINE : 0;
+  // let AYAB request the next lines in advance, so it need not wait for us when the carriage turns around
+  if (apiVersion>=5 && linePrefetch) flags |= AYAB_LINEFLAG_PREFETCH;
+  return flags;
+}
+
+
+void AyabComm::setLinePrefetch(bool aEnable)
+{
+  linePrefetch = aEnable;
+}
+
+
+#pragma mark - row lookahead and statistics
+
+
+void AyabComm::setLookahead(int aRows, AyabRowPeekCB aPeekCB, SimpleCB aAdvanceCB)
+{
+  if (aRows<0) aRows = 0;
+  if (aRows>AYAB_MAX_LOOKAHEAD) aRows = AYAB_MAX_LOOKAHEAD;
+  lookahead = aRows;
+  rowPeekCallBack = aPeekCB;
+  rowAdvanceCallBack = aAdvanceCB;
+  invalidateLookahead();
+}
+
+
+void AyabComm::invalidateLookahead()
+{
+  ringHead = 0;
+  ringCount = 0;
+  if (serialThread) {
+    // frames already passed to the serial thread become stale
+    __atomic_store_n(&ringGeneration, ringGeneration+1, __ATOMIC_RELEASE);
+    ringProduced = 0;
+    ringEndQueued = false;
+    // Note: the thread might still send a stale frame before it notices, and the row source only advances
+    //   when that is reported. So new frames can only be rendered after the thread has confirmed the purge.
+    ringPurgePending = true;
+    wakeSerialThread(); // let it purge stale frames
+  }
+  scheduleLookaheadFill();
+}
+
+
+JsonObjectPtr AyabComm::latencyStatsJSON()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  const char *stageNames[numLatencyStages] = { "dispatch", "callback", "frame", "write", "total" };
+  JsonObjectPtr st = JsonObject::newObj();
+  for (int i=0; i<numLatencyStages; i++) {
+    st->add(stageNames[i], stageLatency[i].statsJSON());
+  }
+  s->add("stages", st);
+  s->add("fromLookahead", rowLatency[0].statsJSON());
+  s->add("renderedOnRequest", rowLatency[1].statsJSON());
+  JsonObjectPtr r = JsonObject::newObj();
+  r->add("restarts", JsonObject::newInt32(restarts));
+  r->add("resetToResponseMS", JsonObject::newInt64(lastResetToResponse!=Never ? lastResetToResponse/MilliSecond : -1));
+  r->add("restartToKnittingMS", JsonObject::newInt64(lastRestartToKnitting!=Never ? lastRestartToKnitting/MilliSecond : -1));
+  r->add("jobStartToKnittingMS", JsonObject::newInt64(lastJobToKnitting!=Never ? lastJobToKnitting/MilliSecond : -1));
+  s->add("restart", r);
+  JsonObjectPtr c = JsonObject::newObj();
+  c->add("linkDown", JsonObject::newBool(linkDown));
+  c->add("reconnects", JsonObject::newInt32(reconnects));
+  c->add("attempts", JsonObject::newInt32(reconnectAttempts));
+  c->add("lastOutageMS", JsonObject::newInt64(lastOutage!=Never ? lastOutage/MilliSecond : -1));
+  c->add("totalOutageMS", JsonObject::newInt64(totalOutage/MilliSecond));
+  c->add("currentOutageMS", JsonObject::newInt64(linkLostTime!=Never ? (MainLoop::now()-linkLostTime)/MilliSecond : -1));
+  s->add("reconnect", c);
+  return s;
+}
+
+
+void AyabComm::scheduleLookaheadFill()
+{
+  if (fillTicket || lookahead==0 || !rowPeekCallBack) return;
+  // fill when current mainloop cycle is done, i.e. after the row just requested is on its way
+  fillTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::fillLookahead, this));
+}
+
+
+void AyabComm::fillLookahead()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(fillTicket); // in case we are called directly
+
+  if (status!=ayabstatus_knitting) return; // only while knitting
+  if (serialThread) {
+    fillThreadFrames();
+    return;
+  }
+  while (ringCount<lookahead) {
+    int last = (ringHead+ringCount-1+AYAB_MAX_LOOKAHEAD) % AYAB_MAX_LOOKAHEAD;
+    if (ringCount>0 && (ringFrames[last][AYAB_LINE_FRAME_BYTES-2] & AYAB_LINEFLAG_LASTLINE)) {
+      break; // no rows after end of job
+    }
+    AyabRow row;
+    if (!rowPeekCallBack(ringCount, row)) {
+      break; // cannot render ahead now
+    }
+    int idx = (ringHead+ringCount) % AYAB_MAX_LOOKAHEAD;
+    buildFrame(row, (uint8_t)(nextRequestRow+ringCount), ringFrames[idx]);
+    ringCount++;
+  }
+}
+
+
+JsonObjectPtr AyabComm::rowStatsJSON()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("lookahead", JsonObject::newInt32(lookahead));
+  s->add("readyRows", JsonObject::newInt32(serialThread ? ringProduced : ringCount));
+  const char *names[2] = { "fromLookahead", "renderedOnRequest" };
+  for (int i=0; i<2; i++) {
+    JsonObjectPtr l = JsonObject::newObj();
+    l->add("count", JsonObject::newInt64(rowLatency[i].count()));
+    l->add("avgLatencyUS", JsonObject::newInt64(rowLatency[i].average()));
+    l->add("maxLatencyUS", JsonObject::newInt64(rowLatency[i].maximum()));
+    s->add(names[i], l);
+  }
+  JsonObjectPtr a = JsonObject::newObj();
+  a->add("lastRow", JsonObject::newInt64(rowAllocsLast));
+  a->add("afterWarmup", JsonObject::newInt64(rowAllocsTotal));
+  a->add("rowsWithAllocations", JsonObject::newInt64(rowsWithAllocs));
+  a->add("warmupRows", JsonObject::newInt32(ALLOC_WARMUP_ROWS));
+  s->add("allocations", a);
+  s->add("repeatedRows", JsonObject::newInt64(repeatedRows));
+  s->add("apiVersion", JsonObject::newInt32(apiVersion));
+  s->add("linePrefetch", JsonObject::newBool(apiVersion>=5 && linePrefetch));
+  if (serialThread) {
+    JsonObjectPtr t = JsonObject::newObj();
+    t->add("priority", JsonObject::newInt32(serialThreadPriority));
+    t->add("eventOverflows", JsonObject::newInt64(__atomic_load_n(&eventOverflows, __ATOMIC_RELAXED)));
+    s->add("serialThread", t);
+  }
+  return s;
+}
+
+
+
+
+#pragma mark - serial I/O thread
+
+// While it runs, the serial thread owns the serial interface, for reading as well as for writing.
+// It answers line requests directly with the frames rendered in advance by the mainloop (frameQueue), and
+// reports everything else it receives, as well as the rows it has sent, back to the mainloop (eventQueue).
+// The mainloop does not write to the serial interface while the thread runs: commands (and responses) are
+// passed to the thread (writeQueue), which writes them between line messages. As the interface is
+// non-blocking and writes may be partial, a single writer is what keeps messages from getting mixed.
+// Confirmations of commands arrive at the mainloop as forwarded bytes.
+
+static bool openWakePipe(int *aFds)
+{
+  if (pipe(aFds)<0) return false;
+  for (int i=0; i<2; i++) {
+    fcntl(aFds[i], F_SETFL, fcntl(aFds[i], F_GETFL) | O_NONBLOCK);
+  }
+  return true;
+}
+
+
+static void closeWakePipe(int *aFds)
+{
+  for (int i=0; i<2; i++) {
+    if (aFds[i]>=0) close(aFds[i]);
+    aFds[i] = -1;
+  }
+}
+
+
+static void wakeUp(int aFd)
+{
+  if (aFd<0) return;
+  uint8_t b = 0;
+  ssize_t res = write(aFd, &b, 1); // if pipe is full, reader is woken anyway
+  (void)res;
+}
+
+
+bool AyabComm::startSerialThread(int aPriority)
+{
+  if (serialThread) return true; // already running
+  if (simulated) {
+    LOG(LOG_WARNING, "Serial I/O thread not available in simulation mode");
+    return false;
+  }
+  serialThreadWanted = true;
+  serialThreadPriority = aPriority;
+  if (linkDown || resendPending) {
+    LOG(LOG_NOTICE, "Serial I/O thread will be started when connection to AYAB is re-established");
+    return true;
+  }
+  serialFd = serialComm->getFd();
+  if (serialFd<0) {
+    LOG(LOG_ERR, "Cannot start serial I/O thread: serial interface is not open");
+    return false;
+  }
+  if (!openWakePipe(threadWakePipe) || !openWakePipe(mainWakePipe)) {
+    LOG(LOG_ERR, "Cannot create pipes for serial I/O thread: %s", strerror(errno));
+    closeWakePipe(threadWakePipe);
+    closeWakePipe(mainWakePipe);
+    return false;
+  }
+  serialThreadStop = false;
+  rxRemaining = 0;
+  rxLineRequest = false;
+  rxSkipCRLF = false;
+  requestPending = false;
+  rowNeededPosted = false;
+  memcpy(threadLastFrame, lastFrame, AYAB_LINE_FRAME_BYTES);
+  threadLastFrameValid = lastFrameValid;
+  rxForward.type = sevent_bytes;
+  rxForward.len = 0;
+  threadGeneration = ringGeneration;
+  // serial thread takes over reading, mainloop only gets the events
+  MainLoop::currentMainLoop().unregisterPollHandler(serialFd);
+  MainLoop::currentMainLoop().registerPollHandler(mainWakePipe[0], POLLIN, boost::bind(&AyabComm::serialEventHandler, this, _1, _2));
+  serialThread = MainLoop::currentMainLoop().executeInThread(
+    boost::bind(&AyabComm::serialThreadRoutine, this, _1),
+    boost::bind(&AyabComm::serialThreadSignal, this, _1, _2)
+  );
+  LOG(LOG_NOTICE, "Serial I/O thread started, %s scheduling (priority %d)", aPriority>0 ? "SCHED_FIFO" : "normal", aPriority);
+  // rows ready so far are in the mainloop's ring, re-render them for the thread
+  invalidateLookahead();
+  return true;
+}
+
+
+void AyabComm::stopSerialThread()
+{
+  if (serialThread) {
+    __atomic_store_n(&serialThreadStop, true, __ATOMIC_RELEASE);
+    wakeSerialThread();
+    serialThread->cancel();
+    serialThread.reset();
+  }
+  if (mainWakePipe[0]>=0) {
+    MainLoop::currentMainLoop().unregisterPollHandler(mainWakePipe[0]);
+  }
+  closeWakePipe(threadWakePipe);
+  closeWakePipe(mainWakePipe);
+}
+
+
+void AyabComm::serialThreadSignal(ChildThreadWrapper &aThread, ThreadSignals aSignalCode)
+{
+  if (__atomic_load_n(&serialThreadStop, __ATOMIC_ACQUIRE)) return; // stopped on purpose
+  if (aSignalCode==threadSignalCompleted || aSignalCode==threadSignalFailedToStart) {
+    // process what the thread has left
+    serialEventHandler(mainWakePipe[0], POLLIN);
+    serialThread.reset();
+    stopSerialThread();
+    takeBackThreadFrames();
+    if (aSignalCode==threadSignalCompleted) {
+      // thread only terminates when the serial interface fails
+      connectionLost(TextError::err("serial I/O thread terminated"));
+      return;
+    }
+    LOG(LOG_ERR, "Serial I/O thread failed to start, serial I/O falls back to mainloop");
+    serialThreadWanted = false;
+    // mainloop monitors the serial interface again
+    monitorLink();
+    invalidateLookahead();
+  }
+}
+
+
+void AyabComm::wakeSerialThread()
+{
+  wakeUp(threadWakePipe[1]);
+}
+
+
+bool AyabComm::threadTransmit(size_t aNumBytes, const uint8_t *aBytes)
+{
+  SerialThreadWrite w;
+  w.len = aNumBytes>AYAB_LINE_FRAME_BYTES ? AYAB_LINE_FRAME_BYTES : aNumBytes;
+  memcpy(w.bytes, aBytes, w.len);
+  if (!writeQueue.push(w)) return false;
+  wakeSerialThread();
+  return true;
+}
+
+
+bool AyabComm::serialEventHandler(int aFD, int aPollFlags)
+{
+  uint8_t buf[64];
+  while (read(mainWakePipe[0], buf, sizeof(buf))>0); // consume wakeups
+  SerialEvent *ev;
+  while ((ev = eventQueue.front())) {
+    switch (ev->type) {
+      case sevent_bytes:
+        // let the operation queue and acceptExtraBytes() process it as if received directly
+        acceptBytes(ev->len, ev->data);
+        break;
+      case sevent_rowSent:
+        threadRowSent(*ev);
+        break;
+      case sevent_rowNeeded:
+        threadRowNeeded(*ev);
+        break;
+      case sevent_rowRepeated:
+        LOG(LOG_WARNING, "AYAB requests line #%d again - serial thread sent it again", ev->rowNo);
+        repeatedRows++;
+        break;
+      case sevent_purged:
+        if (ev->generation==ringGeneration) {
+          // all frames sent before are reported now, row source is up to date
+          ringPurgePending = false;
+          fillLookahead();
+        }
+        break;
+      case sevent_error:
+        LOG(LOG_ERR, "Serial I/O thread: %s: %s", ev->what, strerror(ev->errNo));
+        break;
+    }
+    eventQueue.drop();
+  }
+  return true;
+}
+
+
+void AyabComm::threadRowNeeded(const SerialEvent &aEvent)
+{
+  if (ringProduced>0) return; // rows rendered in advance are already on their way to the serial thread
+  LOG(LOG_INFO, "AYAB requests data for row #%d (overall count %d), no row ready", aEvent.rowNo, rowCount);
+  nextRequestRow = aEvent.rowNo;
+  AyabRow row;
+  if (rowCallBack) {
+    rowCallBack(rowCount, ErrorPtr(), row);
+  }
+  else {
+    row.endOfJob = true;
+  }
+  SerialThreadFrame f;
+  buildFrame(row, aEvent.rowNo, f.frame);
+  f.generation = ringGeneration;
+  f.onRequest = true;
+  if (!frameQueue.push(f)) {
+    LOG(LOG_ERR, "Serial I/O thread frame queue full, cannot pass row");
+  }
+  wakeSerialThread();
+}
+
+
+void AyabComm::threadRowSent(const SerialEvent &aEvent)
+{
+  long allocsBefore = threadAllocationCount();
+  if (!aEvent.onRequest) {
+    // row was rendered in advance, row source must now advance past it
+    if (rowAdvanceCallBack) rowAdvanceCallBack();
+    if (aEvent.generation==ringGeneration) {
+      ringProduced--;
+    }
+    // otherwise: sent after invalidation, but before serial thread noticed. Nothing was rendered
+    //   since, as rendering waits for the purge confirmation, which is reported after this
+  }
+  if (rowCallBack) rowCount++;
+  // keep a copy of the line message as sent
+  lastFrame[0] = AYABCMD_CONFIRM|AYABCMD_FROM_HOST|AYABMSGID_LINE;
+  lastFrame[1] = aEvent.rowNo;
+  memcpy(lastFrame+2, aEvent.data, AYAB_NEEDLE_BYTES);
+  lastFrame[AYAB_LINE_FRAME_BYTES-2] = lineFlags(aEvent.lastLine);
+  lastFrame[AYAB_LINE_FRAME_BYTES-1] = crc8(lastFrame, AYAB_LINE_FRAME_BYTES-1, 0);
+  lastFrameValid = true;
+  status = ayabstatus_knitting;
+  if (!aEvent.lastLine) {
+    logRow(aEvent.data);
+    nextRequestRow = aEvent.rowNo+1;
+  }
+  else {
+    LOG(LOG_NOTICE, "--- End of knitting job - total row count %d", rowCount);
+    status = ayabstatus_ready;
+  }
+  // statistics (rendering happened in advance or in threadRowNeeded(), so no callback/frame stages)
+  MLMicroSeconds now = aEvent.writtenTime;
+  stageLatency[stage_dispatch].add(aEvent.frameTime-aEvent.requestTime, now);
+  stageLatency[stage_write].add(aEvent.writtenTime-aEvent.frameTime, now);
+  stageLatency[stage_total].add(aEvent.writtenTime-aEvent.requestTime, now);
+  rowLatency[aEvent.onRequest ? 1 : 0].add(aEvent.writtenTime-aEvent.requestTime, now);
+  if (!aEvent.lastLine) {
+    fillLookahead();
+  }
+  accountRowAllocs(allocsBefore);
+}
+
+
+void AyabComm::fillThreadFrames()
+{
+  if (ringPurgePending) return; // wait until stale frames are gone
+  bool pushed = false;
+  while (ringProduced<lookahead && !ringEndQueued) {
+    AyabRow row;
+    if (!rowPeekCallBack(ringProduced, row)) {
+      break; // cannot render ahead now
+    }
+    SerialThreadFrame f;
+    buildFrame(row, (uint8_t)(nextRequestRow+ringProduced), f.frame);
+    f.generation = ringGeneration;
+    f.onRequest = false;
+    if (!frameQueue.push(f)) {
+      break; // serial thread has not yet purged stale frames
+    }
+    ringProduced++;
+    if (row.endOfJob) ringEndQueued = true; // no rows after end of job
+    pushed = true;
+  }
+  if (pushed) wakeSerialThread();
+}
+
+
+void AyabComm::serialThreadRoutine(ChildThreadWrapper &aThread)
+{
+  if (serialThreadPriority>0) {
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = serialThreadPriority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (err!=0) threadPostError("cannot set SCHED_FIFO priority", err);
+  }
+  struct pollfd pfd[2];
+  pfd[0].fd = serialFd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = threadWakePipe[0];
+  pfd[1].events = POLLIN;
+  uint8_t buf[64];
+  while (!__atomic_load_n(&serialThreadStop, __ATOMIC_ACQUIRE)) {
+    pfd[0].revents = 0;
+    pfd[1].revents = 0;
+    if (poll(pfd, 2, 1000)<0) {
+      if (errno==EINTR) continue;
+      threadPostError("poll", errno);
+      break;
+    }
+    if (pfd[1].revents & POLLIN) {
+      while (read(threadWakePipe[0], buf, sizeof(buf))>0); // consume wakeups
+      threadPurgeFrames();
+      threadWriteQueued();
+    }
+    if (pfd[0].revents & POLLIN) {
+      ssize_t res = read(serialFd, buf, sizeof(buf));
+      if (res>0) {
+        capture.record(MainLoop::now(), AYAB_CAPTURE_FROM_AYAB, buf, res);
+        threadReceived(buf, res);
+        threadFlushForward();
+      }
+      else if (res==0) {
+        // readable, but no data: other end has closed the connection
+        threadPostError("read from serial interface", ECONNRESET);
+        break;
+      }
+      else if (errno!=EAGAIN && errno!=EINTR) {
+        threadPostError("read from serial interface", errno);
+        break;
+      }
+    }
+    else if (pfd[0].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+      threadPostError("serial interface", EIO);
+      break;
+    }
+    if (requestPending) threadServeRequest();
+  }
+}
+
+
+void AyabComm::threadReceived(const uint8_t *aBytes, size_t aNumBytes)
+{
+  for (size_t i=0; i<aNumBytes; i++) {
+    uint8_t b = aBytes[i];
+    if (rxLineRequest) {
+      // row number of the line request
+      rxLineRequest = false;
+      rxSkipCRLF = true;
+      requestRow = b;
+      requestPending = true;
+      rowNeededPosted = false;
+      threadRequestTime = MainLoop::now();
+      threadServeRequest();
+      continue;
+    }
+    if (rxRemaining!=0) {
+      // within a message to forward
+      threadForward(b);
+      if (rxRemaining>0) rxRemaining--;
+      else if (b=='\n') rxRemaining = 0; // end of text
+      continue;
+    }
+    if (rxSkipCRLF && (b==0x0D || b==0x0A)) continue; // extra CRLF after line request
+    rxSkipCRLF = false;
+    if (b==(AYABCMD_FROM_AYAB|AYABCMD_REQUEST|AYABMSGID_LINE)) {
+      rxLineRequest = true;
+      continue;
+    }
+    if (b==(AYABCMD_FROM_AYAB|AYABCMD_CONFIRM|AYABMSGID_START)) {
+      // (re)started operation, line numbering may start over
+      threadLastFrameValid = false;
+    }
+    // other message: forward entirely, so its contents cannot be mistaken for a line request
+    threadForward(b);
+    int bodyBytes = ayabMessageBodyBytes(b);
+    if (bodyBytes==AYABMSG_TEXT) rxRemaining = -1; // text up to LF
+    else if (bodyBytes>0) rxRemaining = bodyBytes;
+    // unknown: single byte, mainloop will discard it
+  }
+}
+
+
+void AyabComm::threadForward(uint8_t aByte)
+{
+  rxForward.data[rxForward.len++] = aByte;
+  if (rxForward.len>=AYAB_EVENT_DATA_BYTES) threadFlushForward();
 }
 
 
+void AyabComm::threadFlushForward()
+{
+  if (rxForward.len>0) {
+    threadPostEvent(rxForward);
+    rxForward.len = 0;
+  }
+}
+
+
+void AyabComm::threadPurgeFrames()
+{
+  uint32_t gen = __atomic_load_n(&ringGeneration, __ATOMIC_ACQUIRE);
+  SerialThreadFrame *f;
+  while ((f = frameQueue.front()) && !f->onRequest && f->generation!=gen) {
+    frameQueue.drop();
+  }
+  if (gen!=threadGeneration) {
+    // confirm, so mainloop can render for the new generation
+    threadGeneration = gen;
+    SerialEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = sevent_purged;
+    ev.generation = gen;
+    threadPostEvent(ev);
+  }
+}
+
+
+void AyabComm::threadServeRequest()
+{
+  threadFlushForward(); // bytes received before the request go first
+  threadPurgeFrames();
+  SerialThreadFrame *f = frameQueue.front();
+  SerialEvent ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.rowNo = requestRow;
+  ev.requestTime = threadRequestTime;
+  if (threadLastFrameValid && requestRow==threadLastFrame[1]) {
+    // AYAB requests the row just sent again (line message corrupted or lost): send it again, keep the queued frames
+    capture.record(MainLoop::now(), AYAB_CAPTURE_TO_AYAB, threadLastFrame, AYAB_LINE_FRAME_BYTES);
+    bool ok = threadWrite(threadLastFrame, AYAB_LINE_FRAME_BYTES);
+    int err = errno;
+    requestPending = false;
+    if (!ok) threadPostError("write to serial interface", err);
+    ev.type = sevent_rowRepeated;
+    threadPostEvent(ev);
+    return;
+  }
+  if (!f) {
+    // nothing ready, mainloop must render the row now
+    if (!rowNeededPosted) {
+      ev.type = sevent_rowNeeded;
+      threadPostEvent(ev);
+      rowNeededPosted = true;
+    }
+    return;
+  }
+  ev.frameTime = MainLoop::now();
+  if (f->frame[1]!=requestRow) {
+    // request for another row number than expected when rendering
+    f->frame[1] = requestRow;
+    f->frame[AYAB_LINE_FRAME_BYTES-1] = crc8(f->frame, AYAB_LINE_FRAME_BYTES-1, 0);
+  }
+  capture.record(ev.frameTime, AYAB_CAPTURE_TO_AYAB, f->frame, AYAB_LINE_FRAME_BYTES);
+  bool ok = threadWrite(f->frame, AYAB_LINE_FRAME_BYTES);
+  int err = errno;
+  ev.writtenTime = MainLoop::now();
+  ev.type = sevent_rowSent;
+  ev.onRequest = f->onRequest;
+  ev.lastLine = f->frame[AYAB_LINE_FRAME_BYTES-2] & AYAB_LINEFLAG_LASTLINE;
+  ev.generation = f->generation;
+  memcpy(ev.data, f->frame+2, AYAB_NEEDLE_BYTES);
+  memcpy(threadLastFrame, f->frame, AYAB_LINE_FRAME_BYTES);
+  threadLastFrameValid = true;
+  frameQueue.drop();
+  requestPending = false;
+  if (!ok) threadPostError("write to serial interface", err);
+  threadPostEvent(ev);
+}
+
+
+void AyabComm::threadWriteQueued()
+{
+  SerialThreadWrite *w;
+  while ((w = writeQueue.front())) {
+    capture.record(MainLoop::now(), AYAB_CAPTURE_TO_AYAB, w->bytes, w->len);
+    bool ok = threadWrite(w->bytes, w->len);
+    int err = errno;
+    writeQueue.drop();
+    if (!ok) threadPostError("write to serial interface", err);
+  }
+}
+
+
+bool AyabComm::threadWrite(const uint8_t *aBytes, size_t aNumBytes)
+{
+  while (aNumBytes>0) {
+    ssize_t res = write(serialFd, aBytes, aNumBytes);
+    if (res<0) {
+      if (errno==EINTR) continue;
+      if (errno!=EAGAIN) return false;
+      // output buffer full, wait until writable
+      struct pollfd pfd;
+      pfd.fd = serialFd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      int n = poll(&pfd, 1, 1000);
+      if (n==0) errno = ETIMEDOUT;
+      if (n<=0) return false;
+      continue;
+    }
+    aBytes += res;
+    aNumBytes -= res;
+  }
+  return true;
+}
+
+
+void AyabComm::threadPostEvent(const SerialEvent &aEvent)
+{
+  if (!eventQueue.push(aEvent)) {
+    __atomic_add_fetch(&eventOverflows, 1, __ATOMIC_RELAXED);
+  }
+  wakeUp(mainWakePipe[1]);
+}
+
+
+void AyabComm::threadPostError(const char *aWhat, int aErrNo)
+{
+  SerialEvent ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = sevent_error;
+  ev.what = aWhat;
+  ev.errNo = aErrNo;
+  threadPostEvent(ev);
+}
+
+
+
+
+#pragma mark - link loss and reconnect
+
+// When the connection to AYAB (serial device, or serial-to-TCP bridge) fails, it is closed and re-opened
+// with increasing delays. Commands not yet confirmed are kept and sent again once AYAB responds.
+// A running knitting job is resumed without touching the row source: AYAB gets the last line message
+// again, and if it has lost its line counter (reset while disconnected), that row is knitted again.
+
+void AyabComm::monitorLink()
+{
+  // read directly, so a closed or failing connection can be detected
+  int fd = serialComm->getFd();
+  if (fd<0) return;
+  MainLoop::currentMainLoop().unregisterPollHandler(fd);
+  MainLoop::currentMainLoop().registerPollHandler(fd, POLLIN, boost::bind(&AyabComm::linkDataHandler, this, _1, _2));
+}
+
+
+bool AyabComm::linkDataHandler(int aFD, int aPollFlags)
+{
+  if (aPollFlags & POLLIN) {
+    uint8_t buf[64];
+    ssize_t res = read(aFD, buf, sizeof(buf));
+    if (res>0) {
+      capture.record(MainLoop::now(), AYAB_CAPTURE_FROM_AYAB, buf, res);
+      acceptBytes(res, buf);
+    }
+    else if (res==0) {
+      // readable, but no data: other end has closed the connection
+      connectionLost(TextError::err("connection closed"));
+    }
+    else if (errno!=EAGAIN && errno!=EINTR) {
+      connectionLost(SysError::errNo("read from AYAB: "));
+    }
+  }
+  else if (aPollFlags & (POLLERR|POLLHUP|POLLNVAL)) {
+    connectionLost(TextError::err("connection failed (poll flags 0x%X)", aPollFlags));
+  }
+  return true;
+}
+
+
+void AyabComm::connectionLost(ErrorPtr aError)
+{
+  if (linkDown || simulated) return; // already reconnecting
+  LOG(LOG_ERR, "Connection to AYAB lost: %s", aError ? aError->description().c_str() : "unknown reason");
+  linkDown = true;
+  if (linkLostTime==Never) linkLostTime = MainLoop::now(); // if resuming failed, the outage just continues
+  if (serialThread) {
+    stopSerialThread();
+    // rows the thread has sent are accounted for, and the one it could not send is sent after reconnecting
+    serialEventHandler(mainWakePipe[0], POLLIN);
+    takeBackThreadFrames();
+  }
+  if (status==ayabstatus_knitting) resumeKnitting = true;
+  status = ayabstatus_offline;
+  resendPending = false;
+  // close the connection
+  int fd = serialComm->getFd();
+  if (fd>=0) MainLoop::currentMainLoop().unregisterPollHandler(fd);
+  serialComm->closeConnection();
+  // pending commands wait for the link, they will be sent again after reconnecting
+  for (PendingCommandList::iterator pos = pendingCommands.begin(); pos!=pendingCommands.end(); ++pos) {
+    MainLoop::currentMainLoop().cancelExecutionTicket(pos->timeoutTicket);
+  }
+  MainLoop::currentMainLoop().cancelExecutionTicket(reconnectTicket);
+  LOG(LOG_NOTICE, "Reconnecting to AYAB in %lld mS", reconnectDelay/MilliSecond);
+  reconnectTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::reconnect, this), reconnectDelay);
+}
+
+
+void AyabComm::reconnect()
+{
+  reconnectTicket = 0;
+  reconnectAttempts++;
+  if (!serialComm->requestConnection()) {
+    // exponential backoff
+    reconnectDelay *= 2;
+    if (reconnectDelay>AYAB_RECONNECT_MAX_DELAY) reconnectDelay = AYAB_RECONNECT_MAX_DELAY;
+    LOG(LOG_WARNING, "Reconnecting to AYAB failed - next attempt in %lld mS", reconnectDelay/MilliSecond);
+    reconnectTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::reconnect, this), reconnectDelay);
+    return;
+  }
+  LOG(LOG_NOTICE, "Connection to AYAB re-established, waiting for AYAB to respond");
+  linkDown = false;
+  reconnectedTime = MainLoop::now();
+  status = ayabstatus_connected;
+  serialComm->setDTR(false); // keep DTR inactive: no reset, the running job is to be resumed (opening the interface may still reset AYAB, see resumeResponseHandler())
+  setAcceptBuffer(AYAB_MAX_MESSAGE_BYTES); // discards incomplete message received before the link was lost
+  monitorLink();
+  // send the commands that were waiting for the link
+  for (PendingCommandList::iterator pos = pendingCommands.begin(); pos!=pendingCommands.end(); ++pos) {
+    transmitCommand(*pos);
+  }
+  // check if AYAB is there (unless a check from before the link loss is still pending)
+  if (!linkDown && !resumeProbePending) pollResumed();
+}
+
+
+void AyabComm::pollResumed()
+{
+  reconnectTicket = 0;
+  resumeProbePending = true;
+  uint8_t cmd = AYABCMD_FROM_HOST|AYABCMD_REQUEST|AYABMSGID_INFO;
+  sendCommand(1, &cmd, boost::bind(&AyabComm::resumeResponseHandler, this, _1), AYAB_POLL_TIMEOUT, 0); // no retries, polling continues anyway
+}
+
+
+void AyabComm::resumeResponseHandler(ErrorPtr aError)
+{
+  resumeProbePending = false;
+  MLMicroSeconds sinceReconnect = MainLoop::now()-reconnectedTime;
+  if (Error::isOK(aError)) {
+    LOG(LOG_NOTICE, "AYAB responded %lld mS after reconnecting", sinceReconnect/MilliSecond);
+    resumeJob();
+  }
+  else if (sinceReconnect<AYAB_RESTART_TIMEOUT) {
+    // might be booting when connecting has reset it - ask again
+    reconnectTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::pollResumed, this));
+  }
+  else {
+    // connection is open, but AYAB cannot be reached through it
+    connectionLost(TextError::err("AYAB does not respond within %lld seconds after reconnecting", sinceReconnect/Second));
+  }
+}
+
+
+void AyabComm::resumeJob()
+{
+  reconnectDelay = AYAB_RECONNECT_MIN_DELAY; // link works again
+  if (!resumeKnitting) {
+    // no job was running (commands of a job being started are already sent again)
+    resumed();
+    return;
+  }
+  status = ayabstatus_ready;
+  if (resuming) return; // start command from previous attempt is still pending
+  LOG(LOG_NOTICE, "Resuming knitting job at row %d", rowCount);
+  resuming = true;
+  MainLoop::currentMainLoop().cancelExecutionTicket(startTicket);
+  waitingForReady = false;
+  sendStart();
+}
+
+
+void AyabComm::resumed()
+{
+  if (linkLostTime!=Never) {
+    lastOutage = MainLoop::now()-linkLostTime;
+    totalOutage += lastOutage;
+    linkLostTime = Never;
+    reconnects++;
+    LOG(LOG_NOTICE, "Operation resumed after connection loss - %lld mS lost", lastOutage/MilliSecond);
+  }
+  if (serialThreadWanted && !resendPending) startSerialThread(serialThreadPriority);
+}
+
+
+void AyabComm::abandonResume()
+{
+  resumeKnitting = false;
+  resuming = false;
+  resendPending = false;
+  resumeProbePending = false; // aborted along with the other pending commands
+  if (!linkDown && linkLostTime!=Never) {
+    // link is up again, new job or restart takes over from here
+    MainLoop::currentMainLoop().cancelExecutionTicket(reconnectTicket);
+    resumed();
+  }
+}
+
+
+void AyabComm::resendLastFrame(uint8_t aRowNo)
+{
+  if (lastFrame[1]!=aRowNo) {
+    lastFrame[1] = aRowNo;
+    lastFrame[AYAB_LINE_FRAME_BYTES-1] = crc8(lastFrame, AYAB_LINE_FRAME_BYTES-1, 0);
+  }
+  sendResponse(AYAB_LINE_FRAME_BYTES, lastFrame);
+}
+
+
+void AyabComm::takeBackThreadFrames()
+{
+  // serial thread has ended, mainloop can consume its frame queue now
+  SerialThreadFrame *f;
+  while ((f = frameQueue.front())) {
+    if (f->onRequest) {
+      // row source has already advanced past this row, but it could not be sent: must be sent after reconnecting
+      memcpy(lastFrame, f->frame, AYAB_LINE_FRAME_BYTES);
+      lastFrameValid = true;
+      nextRequestRow = f->frame[1]+1;
+      if (rowCallBack) rowCount++;
+    }
+    frameQueue.drop();
+  }
+  // messages not written by the thread: pending commands are sent again after reconnecting
+  while (writeQueue.front()) writeQueue.drop();
+  ringProduced = 0;
+  ringEndQueued = false;
+}
+
+
+
+
 void AyabComm::restart(SimpleCB aDoneCB)
 {
+  MainLoop::currentMainLoop().cancelExecutionTicket(restartTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(startTicket);
+  abortCommands(); // AYAB will not confirm these any more
+  reconfigDoneCB = NULL;
+  waitingForReady = false;
+  abandonResume();
+  restartDoneCB = aDoneCB;
+  restarts++;
+  restartTime = MainLoop::now();
   serialComm->setDTR(true); // arduino reset
-  LOG(LOG_NOTICE, "restarting AYAB - DTR set active and waiting 3 seconds");
+  LOG(LOG_NOTICE, "restarting AYAB - DTR set active");
   status = ayabstatus_offline;
-  MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::endReset, this, aDoneCB), 3*Second);
+  restartTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::endReset, this), AYAB_RESET_PULSE);
 }
 
 
-void AyabComm::endReset(SimpleCB aDoneCB)
+void AyabComm::endReset()
 {
   serialComm->setDTR(false); // arduino reset
-  LOG(LOG_NOTICE, "restarting AYAB - DTR set inactive again and waiting 3 seconds");
+  LOG(LOG_NOTICE, "restarting AYAB - DTR set inactive again, waiting for AYAB to respond");
   status = ayabstatus_connected;
-  MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::restarted, this, aDoneCB), 3*Second);
+  restartTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::pollResponse, this), AYAB_BOOT_DELAY);
+}
+
+
+void AyabComm::pollResponse()
+{
+  restartTicket = 0;
+  // Note: firmware does not send anything by itself after reset, so ask for version info until it answers
+  uint8_t cmd = AYABCMD_FROM_HOST|AYABCMD_REQUEST|AYABMSGID_INFO;
+  sendCommand(1, &cmd, boost::bind(&AyabComm::restartResponseHandler, this, _1), AYAB_POLL_TIMEOUT, 0); // no retries, polling continues anyway
+}
+
+
+void AyabComm::restartResponseHandler(ErrorPtr aError)
+{
+  MLMicroSeconds sinceReset = MainLoop::now()-restartTime;
+  if (Error::isOK(aError)) {
+    lastResetToResponse = sinceReset;
+    LOG(LOG_NOTICE, "restarting AYAB done - AYAB responded %lld mS after reset", sinceReset/MilliSecond);
+    restarted();
+  }
+  else if (sinceReset<AYAB_RESTART_TIMEOUT) {
+    // not yet (still booting, or response was garbled) - ask again
+    restartTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::pollResponse, this));
+  }
+  else {
+    LOG(LOG_ERR, "restarting AYAB - no response within %lld seconds after reset: %s", sinceReset/Second, aError->description().c_str());
+    restarted();
+  }
 }
 
 
-void AyabComm::restarted(SimpleCB aDoneCB)
+void AyabComm::restarted()
 {
-  LOG(LOG_NOTICE, "restarting AYAB done - should be ready in 3 seconds");
-  if (aDoneCB) aDoneCB();
+  SimpleCB cb = restartDoneCB;
+  restartDoneCB = NULL;
+  if (cb) cb();
+}
+
+
+
+
+bool AyabComm::reconfigureJob(unsigned aFirstNeedle, unsigned aWidth, StatusCB aDoneCB)
+{
+  if (status!=ayabstatus_knitting) return false; // no job to reconfigure
+  if (aWidth<2 || aFirstNeedle+aWidth>200) {
+    if (aDoneCB) aDoneCB(TextError::err("Invalid needle range for reconfiguration: firstNeedle=%d, width=%d", aFirstNeedle, aWidth));
+    return true;
+  }
+  // rows already rendered might be different now
+  invalidateLookahead();
+  if (aFirstNeedle==firstNeedle && aWidth==width) {
+    // same needle range, changes just take effect with the next row
+    LOG(LOG_NOTICE, "*** Knitting job reconfigured - needle range unchanged");
+    if (aDoneCB) aDoneCB(ErrorPtr());
+    return true;
+  }
+  firstNeedle = aFirstNeedle;
+  width = aWidth;
+  LOG(LOG_NOTICE, "*** Knitting job reconfigured - firstNeedle=%d, width=%d", firstNeedle, width);
+  reconfigDoneCB = aDoneCB;
+  uint8_t cmd[3];
+  cmd[0] = AYABCMD_FROM_HOST|AYABCMD_REQUEST|AYABMSGID_START;
+  cmd[1] = firstNeedle; // first needle
+  cmd[2] = firstNeedle+width-1; // last needle
+  sendCommand(3, cmd, boost::bind(&AyabComm::reconfigured, this, _1), AYAB_START_TIMEOUT, AYAB_CMD_RETRIES);
+  return true;
+}
+
+
+void AyabComm::reconfigured(ErrorPtr aError)
+{
+  StatusCB cb = reconfigDoneCB;
+  reconfigDoneCB = NULL;
+  if (cb) cb(aError);
 }
 
 
@@ -463,11 +1724,19 @@ bool AyabComm::startKnittingJob(unsigned aFirstNeedle, unsigned aWidth, AyabRowC
   rowCallBack = aRowCB;
   firstNeedle = aFirstNeedle;
   width = aWidth;
+  jobStartTime = MainLoop::now();
+  abortCommands(); // commands of previous job are obsolete
+  reconfigDoneCB = NULL;
+  abandonResume();
+  lastFrameValid = false;
+  MainLoop::currentMainLoop().cancelExecutionTicket(startTicket);
+  waitingForReady = false;
+  invalidateLookahead();
   // check version first
   LOG(LOG_NOTICE, "+++ Start of knitting job - firstNeedle=%d, width=%d", firstNeedle, width);
   uint8_t cmd;
   cmd = AYABCMD_FROM_HOST|AYABCMD_REQUEST|AYABMSGID_INFO;
-  sendCommand(1, &cmd, boost::bind(&AyabComm::ayabVersionResponseHandler, this, _1));
+  sendCommand(1, &cmd, boost::bind(&AyabComm::ayabVersionResponseHandler, this, _1), AYAB_INFO_TIMEOUT, AYAB_CMD_RETRIES);
   return true; // launched job
 }
 
@@ -475,27 +1744,83 @@ bool AyabComm::startKnittingJob(unsigned aFirstNeedle, unsigned aWidth, AyabRowC
 void AyabComm::ayabVersionResponseHandler(ErrorPtr aError)
 {
   if (!Error::isOK(aError)) {
-    rowCallBack(0,aError);
+    AyabRow row;
+    rowCallBack(0, aError, row);
     return;
   }
   // version is ok, now configure
   status = ayabstatus_ready;
+  sendStart();
+}
+
+
+void AyabComm::sendStart()
+{
+  startTicket = 0;
   uint8_t cmd[3];
   cmd[0] = AYABCMD_FROM_HOST|AYABCMD_REQUEST|AYABMSGID_START;
   cmd[1] = firstNeedle; // first needle
   cmd[2] = firstNeedle+width-1; // last needle
-  sendCommand(3, cmd, boost::bind(&AyabComm::ayabStartedResponseHandler, this, _1));
+  sendCommand(3, cmd, boost::bind(&AyabComm::ayabStartedResponseHandler, this, _1), AYAB_START_TIMEOUT, AYAB_CMD_RETRIES);
 }
 
 
 void AyabComm::ayabStartedResponseHandler(ErrorPtr aError)
 {
+  if (aError && aError->isError(AyabCommError::domain(), AyabCommError::NotReady)) {
+    // machine must be initialized by moving the carriage over the left hall sensor first,
+    // AYAB will indicate when this has happened
+    LOG(LOG_NOTICE, "AYAB not ready %s - waiting for carriage to pass left hall sensor", resuming ? "to resume (was reset while disconnected)" : "yet");
+    waitingForReady = true;
+    startTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::sendStart, this), AYAB_START_RETRY_INTERVAL);
+    return;
+  }
   if (!Error::isOK(aError)) {
-    rowCallBack(0,aError);
+    abandonResume();
+    AyabRow row;
+    rowCallBack(0, aError, row);
     return;
   }
+  waitingForReady = false;
+  if (resuming) {
+    // job continues where it was interrupted, row counters and row source stay as they are
+    resuming = false;
+    resumeKnitting = false;
+    status = ayabstatus_knitting;
+    if (lastFrameValid) {
+      // AYAB might not have received the last row before the link was lost: send it again.
+      // If AYAB has it already, it ignores it (no line requested at this time)
+      LOG(LOG_NOTICE, "AYAB resumed knitting - sending row %d again", rowCount);
+      resendLastFrame(lastFrame[1]);
+      resendPending = true; // line number of next request tells if AYAB has kept its line counter
+    }
+    resumed();
+    scheduleLookaheadFill();
+    return;
+  }
+  MLMicroSeconds now = MainLoop::now();
+  lastJobToKnitting = now-jobStartTime;
+  if (restartTime!=Never) {
+    lastRestartToKnitting = now-restartTime;
+    restartTime = Never;
+  }
+  LOG(LOG_NOTICE, "AYAB started knitting %lld mS after job start", lastJobToKnitting/MilliSecond);
   rowCount = 0;
+  rowAllocsTotal = 0;
+  rowsWithAllocs = 0;
+  repeatedRows = 0;
   nextRequestRow = 0; // start at 0, will wrap around after 255 rows
   // now, rowCallBack will be called whenever the machine wants a new row
   status = ayabstatus_knitting;
+  // get first rows ready
+  invalidateLookahead();
+  if (benchmark) {
+    // start requesting rows
+    benchmarkLatency.reset();
+    rowLatency[0].reset();
+    rowLatency[1].reset();
+    benchmarkStart = MainLoop::now();
+    benchmarkEnd = Never;
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&AyabComm::benchmarkRequest, this));
+  }
 }
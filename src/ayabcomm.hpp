@@ -25,40 +25,74 @@
 #include "p44utils_common.hpp"
 
 #include "serialqueue.hpp"
+#include "jsonobject.hpp"
+
+#include "needlepack.hpp"
+#include "latencyhistogram.hpp"
+#include "ayabcapture.hpp"
+#include "spscqueue.hpp"
+
+#include <list>
 
 using namespace std;
 
 namespace p44 {
 
 
+  #define AYAB_NEEDLE_BYTES 25 ///< 200 needles, one bit each
+  #define AYAB_LINE_FRAME_BYTES 29 ///< line message: msgid, row number, needle bytes, flags, CRC
+  #define AYAB_MAX_LOOKAHEAD 32 ///< max number of rows that can be rendered in advance
+  #define AYAB_DEFAULT_LOOKAHEAD 8 ///< default number of rows rendered in advance
+  #define AYAB_FRAME_QUEUE_SIZE 64 ///< line messages passed to the serial thread, must be larger than AYAB_MAX_LOOKAHEAD
+  #define AYAB_EVENT_QUEUE_SIZE 256 ///< events passed from the serial thread to the mainloop
+  #define AYAB_WRITE_QUEUE_SIZE 16 ///< messages the mainloop passes to the serial thread for writing
+  #define AYAB_EVENT_DATA_BYTES 32 ///< max bytes per serial thread event
+  #define AYAB_MAX_COMMAND_BYTES 3 ///< largest command message sent to AYAB
+
   class AyabComm;
-  class AyabRow;
 
 
-  typedef boost::intrusive_ptr<AyabRow> AyabRowPtr;
-  class AyabRow : public P44Obj
+  /// AyabComm specific errors
+  class AyabCommError : public Error
   {
-    typedef P44Obj inherited;
-
   public:
-    AyabRow();
-    virtual ~AyabRow();
-
-    void clear();
-    void setRowSize(size_t aRowSize);
-    void setRowPixel(size_t aPixelNo, bool aValue);
-
-    size_t rowSize;
-    bool *rowData;
+    typedef enum {
+      OK,
+      NotReady, ///< AYAB is not ready to start knitting (carriage has not yet passed the left hall sensor)
+      NoResponse, ///< AYAB did not respond after restart
+    } ErrorCodes;
+
+    static const char *domain() { return "AyabComm"; }
+    virtual const char *getErrorDomain() const { return AyabCommError::domain(); };
+    AyabCommError(ErrorCodes aError) : Error(ErrorCode(aError)) {};
+    AyabCommError(ErrorCodes aError, const std::string &aErrorMessage) : Error(ErrorCode(aError), aErrorMessage) {};
   };
 
 
+  /// one row to knit, placed on the machine's needle bed
+  /// @note plain value type, meant to be allocated on the stack
+  class AyabRow
+  {
+  public:
+    AyabRow() : endOfJob(false) {};
+
+    NeedleMask needles; ///< needles to select, in AYAB line message order (needle 0 = first needle)
+    bool endOfJob; ///< set if there is no row any more, knitting job ends
+  };
 
 
 
+  /// Knitting line by line callback
+  /// @param aRowNum overall row number
+  /// @param aError error, if set, knitting job could not be started, aRow is irrelevant
+  /// @param aRow must be filled with the next row, or set to endOfJob
+  typedef boost::function<void (int aRowNum, ErrorPtr aError, AyabRow &aRow)> AyabRowCB;
 
-  // Knitting line by line callback
-  typedef boost::function<AyabRowPtr (int aRowNum, ErrorPtr aError)> AyabRowCB;
+  /// Row lookahead callback
+  /// @param aAhead number of rows ahead of the row the next AyabRowCB call would return (0 = that row)
+  /// @param aRow must be filled with the row, or set to endOfJob if knitting job ends before that row
+  /// @return false if row cannot be rendered in advance (it will be obtained via AyabRowCB when needed)
+  typedef boost::function<bool (int aAhead, AyabRow &aRow)> AyabRowPeekCB;
 
 
   typedef boost::intrusive_ptr<AyabComm> AyabCommPtr;
@@ -69,6 +103,13 @@ namespace p44 {
 
     bool simulated; ///< if set, AYAB is simulated on console
     bool fullspeedsim; ///< if set, entire knit job is run through automatically quickly
+    bool benchmark; ///< if set, simulated rows are requested back to back, without console interaction
+    SimpleCB benchmarkDoneCB; ///< called when benchmark knitting job has ended
+    MLMicroSeconds benchmarkStart; ///< when the first benchmark row was requested
+    MLMicroSeconds benchmarkEnd; ///< when the last benchmark row was sent
+    LatencyHistogram benchmarkLatency; ///< request-to-send latency of all benchmark rows
+
+    AyabCaptureWriter capture; ///< records serial traffic when open
 
     uint16_t firstNeedle;
     uint16_t width;
@@ -76,6 +117,131 @@ namespace p44 {
     uint8_t nextRequestRow; ///< next row number we expect a request for
     int rowCount; ///< overall row counter
 
+    // row lookahead
+    AyabRowPeekCB rowPeekCallBack; ///< renders rows in advance
+    SimpleCB rowAdvanceCallBack; ///< advances the row source when a row from the ring was sent
+    int lookahead; ///< number of rows to render in advance
+    uint8_t ringFrames[AYAB_MAX_LOOKAHEAD][AYAB_LINE_FRAME_BYTES]; ///< ready to send line messages
+    int ringHead; ///< index of next frame to send
+    int ringCount; ///< number of ready frames
+    long fillTicket; ///< pending ring fill
+
+    // line request latency statistics
+    typedef enum {
+      stage_dispatch, ///< line request received in acceptExtraBytes -> row callback entered (serial thread: -> frame available)
+      stage_callback, ///< row callback entered -> returned (or row taken from ring)
+      stage_frame, ///< row callback returned -> response frame queued in sendResponse()
+      stage_write, ///< response frame queued -> written to serial interface
+      stage_total, ///< line request received -> response written
+      numLatencyStages
+    } LatencyStage;
+    MLMicroSeconds lineRequestTime; ///< when the pending line request was received, Never if none
+    MLMicroSeconds responseQueuedTime; ///< when the last response was passed to sendResponse()
+    MLMicroSeconds responseWrittenTime; ///< when the last response was written
+    LatencyHistogram stageLatency[numLatencyStages]; ///< per stage
+    LatencyHistogram rowLatency[2]; ///< total request-to-send latency, [0]: sent from ring, [1]: rendered on request
+
+    // optional serial I/O thread
+    /// line message passed from the mainloop to the serial thread
+    typedef struct {
+      uint8_t frame[AYAB_LINE_FRAME_BYTES]; ///< line message, row number and CRC are adjusted by the serial thread
+      uint32_t generation; ///< ring generation the row was rendered in
+      bool onRequest; ///< rendered on request (row source already advanced), valid regardless of generation
+    } SerialThreadFrame;
+    /// message (command or response) passed from the mainloop to the serial thread for writing
+    typedef struct {
+      uint8_t len; ///< number of bytes
+      uint8_t bytes[AYAB_LINE_FRAME_BYTES]; ///< message, up to the size of a line message
+    } SerialThreadWrite;
+    typedef enum {
+      sevent_bytes, ///< bytes other than line requests received, to be processed by the mainloop
+      sevent_rowSent, ///< line message sent
+      sevent_rowNeeded, ///< line request received, but no frame ready
+      sevent_rowRepeated, ///< line request for the row just sent again, line message sent again
+      sevent_purged, ///< frames of older generations discarded, generation is the current one
+      sevent_error ///< system error in serial thread
+    } SerialEventType;
+    /// event passed from the serial thread to the mainloop
+    typedef struct {
+      uint8_t type; ///< SerialEventType
+      uint8_t len; ///< number of bytes in data
+      uint8_t rowNo; ///< requested row number
+      bool onRequest; ///< sent frame was rendered on request
+      bool lastLine; ///< sent frame was the last one of the job
+      uint32_t generation; ///< ring generation of the sent frame, or generation purged for
+      int errNo; ///< errno for sevent_error
+      const char *what; ///< static text describing what failed for sevent_error
+      MLMicroSeconds requestTime; ///< when the line request was received
+      MLMicroSeconds frameTime; ///< when a frame for the request was available
+      MLMicroSeconds writtenTime; ///< when the frame was written
+      uint8_t data[AYAB_EVENT_DATA_BYTES]; ///< received bytes, or needle bytes of the sent frame
+    } SerialEvent;
+    ChildThreadWrapperPtr serialThread; ///< the serial thread, if running
+    int serialThreadPriority; ///< SCHED_FIFO priority, 0 = normal scheduling
+    int serialFd; ///< serial interface fd, owned by the serial thread for reading while it runs
+    int threadWakePipe[2]; ///< wakes the serial thread
+    int mainWakePipe[2]; ///< wakes the mainloop
+    bool serialThreadStop; ///< set to make serial thread exit (atomic access)
+    uint32_t ringGeneration; ///< incremented to invalidate frames already passed to the serial thread (atomic access)
+    long eventOverflows; ///< number of events lost because event queue was full (atomic access)
+    int ringProduced; ///< rendered in advance frames passed to the serial thread, not yet reported sent
+    bool ringEndQueued; ///< last line frame is among the produced frames
+    bool ringPurgePending; ///< no rendering ahead until serial thread confirms it has discarded older generations
+    SPSCQueue<SerialThreadFrame, AYAB_FRAME_QUEUE_SIZE> frameQueue; ///< mainloop -> serial thread
+    SPSCQueue<SerialEvent, AYAB_EVENT_QUEUE_SIZE> eventQueue; ///< serial thread -> mainloop
+    SPSCQueue<SerialThreadWrite, AYAB_WRITE_QUEUE_SIZE> writeQueue; ///< mainloop -> serial thread, messages to write
+    // - owned by the serial thread while it runs
+    int rxRemaining; ///< number of bytes still to forward for the current message, -1 = until LF
+    bool rxLineRequest; ///< line request command byte seen, waiting for row number
+    bool rxSkipCRLF; ///< swallow CR/LF after line request
+    bool requestPending; ///< line request waiting for a frame
+    bool rowNeededPosted; ///< sevent_rowNeeded already posted for the pending request
+    uint8_t requestRow; ///< row number of the pending request
+    uint8_t threadLastFrame[AYAB_LINE_FRAME_BYTES]; ///< last line message sent by the serial thread
+    bool threadLastFrameValid; ///< set if threadLastFrame can be sent again on a repeated request
+    uint32_t threadGeneration; ///< ring generation last seen by the serial thread
+    MLMicroSeconds threadRequestTime; ///< when the pending request was received
+    SerialEvent rxForward; ///< collects bytes to forward to the mainloop
+
+    // restart and start of knitting job
+    SimpleCB restartDoneCB; ///< called when restart is done
+    long restartTicket; ///< next step of the restart sequence
+    long startTicket; ///< retry of the start command
+    bool waitingForReady; ///< start command must be sent again when AYAB indicates ready state
+    MLMicroSeconds restartTime; ///< when the last restart was initiated, Never if job has started since
+    MLMicroSeconds jobStartTime; ///< when the current knitting job was requested
+    int restarts; ///< number of restarts
+    MLMicroSeconds lastResetToResponse; ///< time from reset to first response of AYAB in last restart, Never if none
+    MLMicroSeconds lastRestartToKnitting; ///< time from reset to start of knitting in last restart, Never if none
+    MLMicroSeconds lastJobToKnitting; ///< time from job request to start of knitting for last job, Never if none
+    StatusCB reconfigDoneCB; ///< set while waiting for confirmation of new needle range
+
+    // link loss, reconnect and resume of the knitting job
+    bool linkDown; ///< connection to AYAB is lost, reconnect attempts are running
+    bool serialThreadWanted; ///< serial thread must be started again after reconnecting
+    long reconnectTicket; ///< next reconnect attempt, or next poll for AYAB to respond after reconnecting
+    MLMicroSeconds reconnectDelay; ///< delay before next reconnect attempt, doubled after every failed attempt
+    MLMicroSeconds linkLostTime; ///< when the link was lost, Never if no outage is in progress
+    MLMicroSeconds reconnectedTime; ///< when the link was re-established
+    bool resumeKnitting; ///< knitting job was running when the link was lost, must be resumed
+    bool resuming; ///< start command sent to resume the job, confirmation must not reset row counters
+    bool resumeProbePending; ///< info request checking if AYAB responds after reconnecting is pending
+    bool resendPending; ///< first line request after resuming decides if the last line message must be knitted again
+    uint8_t lastFrame[AYAB_LINE_FRAME_BYTES]; ///< last line message sent
+    bool lastFrameValid; ///< set if lastFrame contains a line message of the current job
+    uint8_t apiVersion; ///< API version reported by AYAB, 0 if not known yet
+    bool linePrefetch; ///< let AYAB (API v5) request lines in advance
+    long repeatedRows; ///< number of line requests for the row just sent (line message not received intact by AYAB)
+    int reconnects; ///< number of outages resumed from
+    int reconnectAttempts; ///< number of reconnect attempts (including failed ones)
+    MLMicroSeconds lastOutage; ///< time from link loss to resumed operation in last outage, Never if none
+    MLMicroSeconds totalOutage; ///< total time lost in outages
+
+    // heap allocations in the row path (debug counter, see alloccounter.hpp)
+    long rowAllocsLast; ///< allocations done while sending the last row
+    long rowAllocsTotal; ///< allocations done while sending rows after warm-up
+    long rowsWithAllocs; ///< number of rows after warm-up that did any allocation
+
     typedef enum {
       ayabstatus_offline,
       ayabstatus_connected,
@@ -85,6 +251,20 @@ namespace p44 {
 
     AyabStatus status;
 
+    // commands waiting for confirmation
+    typedef struct {
+      unsigned serial; ///< identifies the command for its timeout
+      uint8_t bytes[AYAB_MAX_COMMAND_BYTES]; ///< command message
+      size_t len; ///< command message length
+      MLMicroSeconds timeout; ///< confirmation timeout for each attempt
+      int retries; ///< number of times the command will still be sent again
+      long timeoutTicket; ///< pending timeout
+      StatusCB confirmCB; ///< called when confirmed or finally timed out
+    } PendingCommand;
+    typedef std::list<PendingCommand> PendingCommandList;
+    PendingCommandList pendingCommands; ///< confirmations are matched to the oldest pending command with the same message id
+    unsigned commandSerial; ///< last command serial number used
+
   public:
 
     AyabComm(MainLoop &aMainLoop);
@@ -95,39 +275,144 @@ namespace p44 {
     /// @param aDefaultPort default port number for TCP connection (irrelevant for direct serial device connection)
     void setConnectionSpecification(const char *aConnectionSpec, uint16_t aDefaultPort);
 
-    /// restart the AYAB (disconnect, wait, reconnect)
-    /// @param aDoneCB called when restart is done
+    /// headless simulation for benchmarking: no AYAB, rows of knitting jobs are requested as fast as possible,
+    /// through the same rendering and framing path as with a real AYAB
+    /// @param aDoneCB called when a knitting job has ended, results are available from benchmarkStatsJSON()
+    /// @note use instead of setConnectionSpecification()
+    void setBenchmarkMode(SimpleCB aDoneCB);
+
+    /// record all bytes received from and sent to AYAB into a capture file (for replaying with ayabreplay)
+    /// @param aPath capture file, records are appended
+    /// @return error if file cannot be opened
+    /// @note must be called before startSerialThread()
+    ErrorPtr setCaptureFile(const char *aPath);
+
+    /// let AYAB request lines in advance into its line buffers (firmware API version 5), so the next row is
+    /// ready when the carriage turns around. Enabled by default.
+    /// @param aEnable if false, AYAB requests one line at a time, at the end of a row (like API version 4)
+    /// @note with prefetch, rows are taken from the row source up to 3 rows before they are knitted,
+    ///   so changes to the rows take effect correspondingly later
+    void setLinePrefetch(bool aEnable);
+
+    /// restart the AYAB (reset pulse, then poll until AYAB responds)
+    /// @param aDoneCB called when AYAB responds again, or when it did not respond within a few seconds
     void restart(SimpleCB aDoneCB);
 
     /// start knitting job
     /// @param aFirstNeedle number of the first needle from the left to use (0..199)
     /// @param aWidth width in number of needles
-    /// @param aRowCB is called once for every row, must return a AyabRow or nothing to end knitting job
+    /// @param aRowCB is called once for every row, must fill in the row or signal end of knitting job
     /// @return true if params ok, false otherwise
     bool startKnittingJob(unsigned aFirstNeedle, unsigned aWidth, AyabRowCB aRowCB);
 
+    /// change the needle range of the running knitting job without restarting AYAB
+    /// @param aFirstNeedle new first needle
+    /// @param aWidth new width
+    /// @param aDoneCB called when AYAB has confirmed the new needle range (immediately if range is unchanged).
+    ///   If called with an error, AYAB did not accept the range, and should be restarted.
+    /// @return false if no knitting job is running (nothing done, aDoneCB not called)
+    /// @note rows already rendered in advance are discarded, so other changes of the rows also take effect with the next row
+    bool reconfigureJob(unsigned aFirstNeedle, unsigned aWidth, StatusCB aDoneCB);
+
+    /// set up rendering rows in advance (in idle time, ready to be sent when AYAB requests them)
+    /// @param aRows number of rows to keep ready, 0 to disable
+    /// @param aPeekCB called to render rows ahead
+    /// @param aAdvanceCB called after a row rendered in advance has been sent, must advance the row source
+    ///   exactly as a call to the AyabRowCB would
+    void setLookahead(int aRows, AyabRowPeekCB aPeekCB, SimpleCB aAdvanceCB);
+
+    /// discard all rows rendered in advance, must be called whenever rows already rendered might change
+    void invalidateLookahead();
+
+    /// run serial I/O in a dedicated thread, which answers line requests directly from the rows rendered
+    /// in advance, so AYAB does not need to wait for the mainloop (file I/O, API requests...)
+    /// @param aPriority 0 for normal scheduling, 1..99 for SCHED_FIFO realtime priority (needs privileges)
+    /// @return true if thread could be started
+    /// @note must be called after setConnectionSpecification(), not available in simulation mode.
+    ///   When the connection is not open (yet), the thread is started once the connection is established.
+    bool startSerialThread(int aPriority);
+
+    /// @return row request statistics as JSON
+    JsonObjectPtr rowStatsJSON();
+
+    /// @return line request latency histograms (per stage), restart-to-knitting times and reconnect statistics as JSON
+    JsonObjectPtr latencyStatsJSON();
+
+    /// @return results of the last benchmark run (rows, throughput, row latency) as JSON
+    JsonObjectPtr benchmarkStatsJSON();
+
     AyabStatus getStatus() { return status; };
 
   protected:
 
-    /// called to process extra bytes after all pending operations have processed their bytes
+    /// called to process bytes received from AYAB: frames and processes messages
     virtual ssize_t acceptExtraBytes(size_t aNumBytes, uint8_t *aBytes);
 
   private:
 
-    void sendCommand(size_t aCmdLength, uint8_t *aCmdBytesP, StatusCB aStatusCB);
+    void sendCommand(size_t aCmdLength, uint8_t *aCmdBytesP, StatusCB aStatusCB, MLMicroSeconds aTimeout, int aRetries);
+    void transmitCommand(PendingCommand &aCmd);
+    void commandTimeout(unsigned aSerial);
+    void abortCommands();
+    bool confirmReceived(const uint8_t *aMsg);
+    void processMessage(const uint8_t *aMsg, size_t aMsgLen);
     void sendResponse(size_t aRespLength, uint8_t *aRespBytesP);
-    void ayabCmdResponseHandler(StatusCB aStatusCB, SerialOperationReceivePtr aRecOp, ErrorPtr aError);
 
     void ayabVersionResponseHandler(ErrorPtr aError);
+    void sendStart();
+    void reconfigured(ErrorPtr aError);
     void ayabStartedResponseHandler(ErrorPtr aError);
 
     void sendNextRow();
+    void buildFrame(const AyabRow &aRow, uint8_t aRowNo, uint8_t *aFrame);
+    uint8_t lineFlags(bool aLastLine);
+    void scheduleLookaheadFill();
+    void fillLookahead();
 
-    bool simulationControlKeyHandler(char aKey);
+    void logRow(const uint8_t *aNeedles);
+    void accountRowAllocs(long aAllocsBefore);
 
-    void endReset(SimpleCB aDoneCB);
-    void restarted(SimpleCB aDoneCB);
+    bool simulationControlKeyHandler(char aKey);
+    void benchmarkRequest();
+
+    // serial thread, mainloop side
+    void stopSerialThread();
+    void serialThreadSignal(ChildThreadWrapper &aThread, ThreadSignals aSignalCode);
+    bool serialEventHandler(int aFD, int aPollFlags);
+    void threadRowSent(const SerialEvent &aEvent);
+    void threadRowNeeded(const SerialEvent &aEvent);
+    void wakeSerialThread();
+    void fillThreadFrames();
+    bool threadTransmit(size_t aNumBytes, const uint8_t *aBytes);
+    // serial thread, thread side
+    void serialThreadRoutine(ChildThreadWrapper &aThread);
+    void threadReceived(const uint8_t *aBytes, size_t aNumBytes);
+    void threadForward(uint8_t aByte);
+    void threadFlushForward();
+    void threadServeRequest();
+    void threadWriteQueued();
+    bool threadWrite(const uint8_t *aBytes, size_t aNumBytes);
+    void threadPostEvent(const SerialEvent &aEvent);
+    void threadPostError(const char *aWhat, int aErrNo);
+    void threadPurgeFrames();
+
+    // link loss and reconnect
+    void monitorLink();
+    bool linkDataHandler(int aFD, int aPollFlags);
+    void connectionLost(ErrorPtr aError);
+    void reconnect();
+    void pollResumed();
+    void resumeResponseHandler(ErrorPtr aError);
+    void resumeJob();
+    void resumed();
+    void abandonResume();
+    void resendLastFrame(uint8_t aRowNo);
+    void takeBackThreadFrames();
+
+    void endReset();
+    void pollResponse();
+    void restartResponseHandler(ErrorPtr aError);
+    void restarted();
 
   };
 
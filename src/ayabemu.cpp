@@ -0,0 +1,669 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// AYAB firmware emulator: opens a pseudo terminal and speaks the AYAB serial protocol (API version 5, or 4 with -4)
+// on it like ayab.ino/knitter.cpp do, including their timing quirks (64 byte serial receive buffer,
+// incomplete messages discarded after a timeout, delay before the very first line request). The knitting machine is replaced
+// by a carriage that finishes a pass every line period (optionally with jitter).
+// p44ayabd connects to it like to a real AYAB: p44ayabd --ayabconnection /dev/pts/N
+// Usage: ayabemu -h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+#include <vector>
+#include <algorithm>
+
+#define API_VERSION 5
+#define FW_VERSION_MAJ 0
+#define FW_VERSION_MIN 90
+
+#define NUM_NEEDLES 200
+#define LINE_BYTES 25
+#define LINE_BUFFER_COUNT 4 // lines held in advance when the host sets the prefetch flag (API v5)
+#define LINEFLAG_LASTLINE 0x01
+#define LINEFLAG_PREFETCH 0x02
+#define SERIAL_RX_BUFFER 64 // Arduino serial receive buffer, bytes arriving when it is full are lost
+#define MSG_TIMEOUT_US 100000 // incomplete message is discarded when no more bytes arrive within this time
+#define FIRST_LINE_DELAY_US 2000000 // state_operate() waits 2S before the very first line request after power up
+#define TEST_STATE_INTERVAL_US 500000 // state_test() sends state every 500mS
+#define HALL_VALUE_L 420 // hall sensor values reported in state indications
+#define HALL_VALUE_R 380
+#define MAX_LATENCY_SAMPLES 1000000
+
+// AYAB API v4/v5 message ids
+#define reqStart_msgid 0x01
+#define cnfStart_msgid 0xC1
+#define reqLine_msgid 0x82
+#define cnfLine_msgid 0x42
+#define reqInfo_msgid 0x03
+#define cnfInfo_msgid 0xC3
+#define reqTest_msgid 0x04
+#define cnfTest_msgid 0xC4
+#define indState_msgid 0x84
+
+typedef int64_t USec;
+
+static USec now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (USec)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+
+static volatile sig_atomic_t terminated = 0;
+static volatile sig_atomic_t statsRequested = 0;
+
+static void terminationHandler(int) { terminated = 1; }
+static void statsHandler(int) { statsRequested = 1; }
+
+
+class AyabEmulator
+{
+public:
+
+  // settings
+  USec linePeriod; ///< time for one carriage pass
+  USec jitter; ///< max random deviation of the line period
+  USec readyDelay; ///< time from start until the carriage passes the left hall sensor
+  double dropRate; ///< probability for each byte (both directions) to get lost
+  double garbageRate; ///< probability for garbage bytes to precede a message to the host
+  bool fast; ///< no delay before first line request
+  int apiVersion; ///< API version to emulate, 4 = no line prefetch
+  bool verbose;
+  USec statsInterval; ///< interval for printing statistics, 0 = only at exit and on SIGUSR1
+
+private:
+
+  int fd; ///< pty master
+
+  // serial receive buffer
+  uint8_t rx[SERIAL_RX_BUFFER];
+  size_t rxLen;
+
+  // message being received (as in ayab.ino loop())
+  uint8_t msg[LINE_BYTES+4];
+  size_t msgLen; ///< bytes received so far
+  size_t msgExpected; ///< length of message being received, 0 = none
+  USec msgLastByte; ///< when the last byte of the message was received
+
+  // firmware state (as in knitter.cpp)
+  enum { s_init, s_ready, s_operate, s_test } opState;
+  uint8_t startNeedle;
+  uint8_t stopNeedle;
+  uint8_t lineBuffer[LINE_BUFFER_COUNT][LINE_BYTES];
+  uint8_t knitSlot; ///< buffer of the line being knitted
+  uint8_t linesAhead; ///< lines received in advance
+  bool needLine; ///< line being knitted is done, next one not received yet
+  bool prefetch; ///< host allows requesting lines ahead
+  uint8_t currentLineNumber;
+  bool lineRequested;
+  bool lastLineFlag;
+  bool firstRun; ///< static in state_operate(), only the first operation after power up
+  // emulation of the blocking delay before the very first line request
+  USec busyUntil; ///< firmware is in delay() until then, 0 if not
+  // machine
+  USec readyTime; ///< when the carriage passes the left hall sensor
+  USec passEnd; ///< when the current carriage pass ends (operating only)
+  USec nextTestState; ///< next state indication in test mode
+
+  // statistics
+  USec startTime;
+  USec firstRequestTime;
+  USec requestTime; ///< when the currently pending line was first requested
+  long requests; ///< line requests sent (including re-requests)
+  long accepted; ///< lines accepted
+  long late; ///< carriage passes that ended without the requested line (knitted the old line again)
+  long mismatches; ///< lines with unexpected line number (rejected and requested again)
+  long crcErrors; ///< lines with CRC mismatch (rejected and requested again)
+  long jobs; ///< knitting jobs ended with last line
+  long rxOverflows; ///< bytes lost because receive buffer was full
+  long dropped; ///< bytes dropped on purpose
+  long garbage; ///< garbage bytes inserted
+  long unknown; ///< unknown command bytes ignored
+  long incomplete; ///< incomplete messages discarded after timeout
+  std::vector<int32_t> latencies; ///< line request to complete line received, in uS
+
+public:
+
+  AyabEmulator() :
+    linePeriod(1000000),
+    jitter(0),
+    readyDelay(1000000),
+    dropRate(0),
+    garbageRate(0),
+    fast(false),
+    apiVersion(API_VERSION),
+    verbose(false),
+    statsInterval(0),
+    fd(-1),
+    rxLen(0),
+    msgLen(0),
+    msgExpected(0),
+    msgLastByte(0),
+    opState(s_init),
+    startNeedle(0),
+    stopNeedle(0),
+    knitSlot(0),
+    linesAhead(0),
+    needLine(true),
+    prefetch(false),
+    currentLineNumber(0),
+    lineRequested(false),
+    lastLineFlag(false),
+    firstRun(true),
+    busyUntil(0),
+    passEnd(0),
+    nextTestState(0),
+    firstRequestTime(0),
+    requestTime(0),
+    requests(0), accepted(0), late(0), mismatches(0), crcErrors(0), jobs(0),
+    rxOverflows(0), dropped(0), garbage(0), unknown(0), incomplete(0)
+  {
+    memset(lineBuffer, 0, sizeof(lineBuffer));
+    memset(msg, 0, sizeof(msg));
+  }
+
+
+  /// open the pty
+  /// @param aLinkPath if not NULL, a symlink to the pty slave is created at this path
+  /// @return slave fd (must be kept open), -1 on failure
+  int openPty(const char *aLinkPath)
+  {
+    fd = posix_openpt(O_RDWR|O_NOCTTY);
+    if (fd<0 || grantpt(fd)<0 || unlockpt(fd)<0) {
+      perror("cannot open pseudo terminal");
+      return -1;
+    }
+    const char *slaveName = ptsname(fd);
+    // keep the slave open, so the master does not see a hangup when p44ayabd closes and re-opens it
+    int sfd = open(slaveName, O_RDWR|O_NOCTTY);
+    if (sfd<0) {
+      perror("cannot open pseudo terminal slave");
+      return -1;
+    }
+    // raw, so nothing gets echoed or translated before p44ayabd sets up the interface
+    struct termios t;
+    tcgetattr(sfd, &t);
+    cfmakeraw(&t);
+    tcsetattr(sfd, TCSANOW, &t);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (aLinkPath) {
+      unlink(aLinkPath);
+      if (symlink(slaveName, aLinkPath)<0) perror("cannot create symlink");
+    }
+    printf("AYAB emulator (API version %d) on %s%s%s\n", apiVersion, slaveName, aLinkPath ? " -> " : "", aLinkPath ? aLinkPath : "");
+    fflush(stdout);
+    return sfd;
+  }
+
+
+  void run()
+  {
+    startTime = now();
+    readyTime = startTime+readyDelay;
+    USec nextStats = statsInterval ? startTime+statsInterval : 0;
+    while (!terminated) {
+      USec t = now();
+      if (statsRequested || (nextStats && t>=nextStats)) {
+        statsRequested = 0;
+        if (nextStats) nextStats = t+statsInterval;
+        printStats();
+      }
+      // wait for input or the next timed event
+      USec next = t+1000000;
+      if (busyUntil) next = std::min(next, busyUntil);
+      else {
+        if (msgExpected) next = std::min(next, msgLastByte+MSG_TIMEOUT_US+1);
+        if (opState==s_init) next = std::min(next, readyTime);
+        if (opState==s_operate) next = std::min(next, passEnd);
+        if (opState==s_test) next = std::min(next, nextTestState);
+      }
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int timeout = next>t ? (int)((next-t+999)/1000) : 0;
+      if (poll(&pfd, 1, timeout)<0 && errno!=EINTR) {
+        perror("poll");
+        break;
+      }
+      if (pfd.revents & POLLIN) receive();
+      t = now();
+      if (busyUntil) {
+        // in a delay(): only the serial receive interrupt works
+        if (t<busyUntil) continue;
+        busyUntil = 0;
+        firstLineRequest(t);
+      }
+      // like loop() in ayab.ino: state machine, then at most one message from serial
+      while (!busyUntil && !terminated) {
+        fsm(t);
+        if (busyUntil || rxLen==0) break;
+        receiveMessage(t);
+      }
+      if (msgExpected && t-msgLastByte>MSG_TIMEOUT_US) {
+        // rest of the message got lost
+        incomplete++;
+        if (verbose) fprintf(stderr, "incomplete message 0x%02X discarded after %d of %d bytes\n", msg[0], (int)msgLen, (int)msgExpected);
+        msgExpected = 0;
+      }
+    }
+    printStats();
+  }
+
+
+private:
+
+  bool chance(double aProbability)
+  {
+    return aProbability>0 && rand()<aProbability*RAND_MAX;
+  }
+
+
+  USec nextPassDuration()
+  {
+    if (jitter<=0) return linePeriod;
+    USec d = linePeriod-jitter+(USec)((double)rand()/RAND_MAX*2*jitter);
+    return d>0 ? d : 0;
+  }
+
+
+  void receive()
+  {
+    uint8_t buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    for (ssize_t i=0; i<n; i++) {
+      if (chance(dropRate)) { dropped++; continue; }
+      if (rxLen>=SERIAL_RX_BUFFER) { rxOverflows++; continue; }
+      rx[rxLen++] = buf[i];
+    }
+  }
+
+
+  /// Serial.read()
+  uint8_t readByte()
+  {
+    if (rxLen==0) return 0xFF; // Serial.read() returns -1 when nothing is available
+    uint8_t b = rx[0];
+    memmove(rx, rx+1, --rxLen);
+    return b;
+  }
+
+
+  /// Serial.write() of a message followed by Serial.println("")
+  void sendMessage(const uint8_t *aMsg, size_t aLen)
+  {
+    uint8_t buf[64];
+    size_t n = 0;
+    if (chance(garbageRate)) {
+      int g = 1+rand()%4;
+      for (int i=0; i<g; i++) buf[n++] = rand() & 0xFF;
+      garbage += g;
+    }
+    for (size_t i=0; i<aLen+2; i++) {
+      uint8_t b = i<aLen ? aMsg[i] : (i==aLen ? 0x0D : 0x0A);
+      if (chance(dropRate)) { dropped++; continue; }
+      buf[n++] = b;
+    }
+    if (n>0 && write(fd, buf, n)<0 && verbose) perror("write");
+  }
+
+
+  /// @return length of a message from the host, 0 for unknown message ids
+  static size_t msgLength(uint8_t aMsgId)
+  {
+    switch (aMsgId) {
+      case reqStart_msgid: return 3;
+      case cnfLine_msgid: return LINE_BYTES+4;
+      case reqInfo_msgid: return 1;
+      case reqTest_msgid: return 1;
+      default: return 0;
+    }
+  }
+
+
+  /// collect bytes of a message, dispatch it when complete
+  void receiveMessage(USec aNow)
+  {
+    while (rxLen>0) {
+      uint8_t b = readByte();
+      if (msgExpected==0) {
+        // start of a message
+        msgExpected = msgLength(b);
+        msgLen = 0;
+        if (msgExpected==0) {
+          unknown++;
+          if (verbose) fprintf(stderr, "ignored byte 0x%02X\n", b);
+          continue;
+        }
+      }
+      msg[msgLen++] = b;
+      msgLastByte = aNow;
+      if (msgLen>=msgExpected) {
+        msgExpected = 0;
+        dispatch(aNow);
+        break; // one message per loop, fsm must run in between
+      }
+    }
+  }
+
+
+  void dispatch(USec aNow)
+  {
+    switch (msg[0]) {
+      case reqStart_msgid: {
+        if (opState!=s_operate) memset(lineBuffer, 0xFF, sizeof(lineBuffer));
+        bool success = startOperation(msg[1], msg[2], aNow);
+        if (verbose) fprintf(stderr, "start %d..%d: %s\n", msg[1], msg[2], success ? "ok" : "failed");
+        uint8_t m[2] = { cnfStart_msgid, success };
+        sendMessage(m, 2);
+        break;
+      }
+      case cnfLine_msgid: {
+        uint8_t crc = 0;
+        for (size_t i=0; i<LINE_BYTES+3; i++) crc = crc8Step(crc, msg[i]);
+        if (crc!=msg[LINE_BYTES+3]) {
+          // corrupted on the way, have it sent again
+          crcErrors++;
+          if (verbose) fprintf(stderr, "line #%d with CRC mismatch\n", msg[1]);
+          if (lineRequested) reqLine(currentLineNumber, aNow);
+          break;
+        }
+        uint8_t *buf = setNextLine(msg[1], aNow);
+        if (buf) {
+          for (int i=0; i<LINE_BYTES; i++) buf[i] = ~msg[2+i];
+          prefetch = apiVersion>=5 && (msg[LINE_BYTES+2] & LINEFLAG_PREFETCH);
+          if (msg[LINE_BYTES+2] & LINEFLAG_LASTLINE) lastLineFlag = true;
+        }
+        break;
+      }
+      case reqInfo_msgid: {
+        uint8_t m[4] = { cnfInfo_msgid, (uint8_t)apiVersion, FW_VERSION_MAJ, FW_VERSION_MIN };
+        sendMessage(m, 4);
+        break;
+      }
+      case reqTest_msgid: {
+        bool success = opState==s_init || opState==s_ready;
+        if (success) {
+          opState = s_test;
+          nextTestState = aNow;
+        }
+        uint8_t m[2] = { cnfTest_msgid, success };
+        sendMessage(m, 2);
+        break;
+      }
+    }
+  }
+
+
+  /// end of the delay before the very first line request
+  void firstLineRequest(USec aNow)
+  {
+    reqLine(++currentLineNumber, aNow);
+    passEnd = aNow+nextPassDuration();
+  }
+
+
+  bool startOperation(uint8_t aStartNeedle, uint8_t aStopNeedle, USec aNow)
+  {
+    if (aStopNeedle>=NUM_NEEDLES || aStartNeedle>=aStopNeedle) return false;
+    if (opState==s_ready) {
+      opState = s_operate;
+      startNeedle = aStartNeedle;
+      stopNeedle = aStopNeedle;
+      currentLineNumber = 255; // incremented before request
+      lineRequested = false;
+      lastLineFlag = false;
+      knitSlot = 0;
+      linesAhead = 0;
+      needLine = true;
+      prefetch = false;
+      if (firstRun) {
+        // first request comes after a delay, all later jobs get their first line after the first pass
+        firstRun = false;
+        busyUntil = now()+(fast ? 0 : FIRST_LINE_DELAY_US);
+        if (busyUntil==0) busyUntil = 1;
+      }
+      else {
+        passEnd = aNow+nextPassDuration();
+      }
+      return true;
+    }
+    else if (opState==s_operate) {
+      // reconfiguration of the running operation
+      startNeedle = aStartNeedle;
+      stopNeedle = aStopNeedle;
+      return true;
+    }
+    return false;
+  }
+
+
+  /// @return buffer to store the line in, NULL if not accepted
+  uint8_t *setNextLine(uint8_t aLineNumber, USec aNow)
+  {
+    if (lineRequested) {
+      if (aLineNumber==currentLineNumber) {
+        lineRequested = false;
+        accepted++;
+        if (latencies.size()<MAX_LATENCY_SAMPLES) latencies.push_back((int32_t)(aNow-requestTime));
+        if (verbose) fprintf(stderr, "line #%d accepted after %.1f mS%s\n", aLineNumber, (aNow-requestTime)/1000.0, needLine ? "" : " (in advance)");
+        if (needLine) {
+          // carriage is waiting for it (or knits the old line again)
+          needLine = false;
+          return lineBuffer[knitSlot];
+        }
+        linesAhead++;
+        return lineBuffer[(knitSlot+linesAhead) % LINE_BUFFER_COUNT];
+      }
+      // line numbers didn't match -> request again
+      mismatches++;
+      if (verbose) fprintf(stderr, "line #%d received, but #%d requested\n", aLineNumber, currentLineNumber);
+      reqLine(currentLineNumber, aNow);
+    }
+    return NULL;
+  }
+
+
+  /// current line is done, continue with the next one if already received
+  bool nextLine()
+  {
+    if (linesAhead>0) {
+      knitSlot = (knitSlot+1) % LINE_BUFFER_COUNT;
+      linesAhead--;
+      return true;
+    }
+    needLine = true;
+    return false;
+  }
+
+
+  void reqLine(uint8_t aLineNumber, USec aNow)
+  {
+    if (!lineRequested) requestTime = aNow; // latency counts from first request
+    if (firstRequestTime==0) firstRequestTime = aNow;
+    requests++;
+    uint8_t m[2] = { reqLine_msgid, aLineNumber };
+    sendMessage(m, 2);
+    lineRequested = true;
+  }
+
+
+  void indState(bool aInitState)
+  {
+    uint8_t m[8] = {
+      indState_msgid, aInitState,
+      HALL_VALUE_L>>8, HALL_VALUE_L & 0xFF,
+      HALL_VALUE_R>>8, HALL_VALUE_R & 0xFF,
+      1, // K carriage
+      0 // needle
+    };
+    sendMessage(m, 8);
+  }
+
+
+  void fsm(USec aNow)
+  {
+    switch (opState) {
+      case s_init:
+        if (aNow>=readyTime) {
+          // carriage has passed the left hall sensor
+          opState = s_ready;
+          indState(true);
+          if (verbose) fprintf(stderr, "ready\n");
+        }
+        break;
+      case s_operate:
+        if (aNow>=passEnd) {
+          // carriage has left the needles of the current line
+          if (nextLine()) {
+            // line received in advance, knit it right away
+          }
+          else if (!lineRequested && !lastLineFlag) {
+            reqLine(++currentLineNumber, aNow);
+          }
+          else if (lastLineFlag) {
+            opState = s_ready;
+            jobs++;
+            if (verbose) fprintf(stderr, "end of job\n");
+            break;
+          }
+          else {
+            // line has not arrived in time, old line was knitted again
+            late++;
+            if (verbose) fprintf(stderr, "line #%d late\n", currentLineNumber);
+          }
+          passEnd = aNow+nextPassDuration();
+        }
+        if (prefetch && !lineRequested && !lastLineFlag && !needLine && linesAhead<LINE_BUFFER_COUNT-1) {
+          // a buffer is free, request the next line ahead
+          reqLine(++currentLineNumber, aNow);
+        }
+        break;
+      case s_test:
+        if (aNow>=nextTestState) {
+          indState(false);
+          nextTestState = aNow+TEST_STATE_INTERVAL_US;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+
+  static uint8_t crc8Step(uint8_t aCrc, uint8_t aByte)
+  {
+    // same CRC-8 (polynomial 0x07) as p44ayabd uses
+    aCrc ^= aByte;
+    for (int i=0; i<8; i++) aCrc = aCrc & 0x80 ? (aCrc<<1)^0x07 : aCrc<<1;
+    return aCrc;
+  }
+
+
+  void printStats()
+  {
+    USec t = now();
+    printf("--- after %.1f S:\n", (t-startTime)/1e6);
+    printf("line requests: %ld, lines accepted: %ld, late: %ld, wrong line number: %ld, CRC mismatch: %ld, jobs done: %ld\n",
+      requests, accepted, late, mismatches, crcErrors, jobs);
+    printf("bytes lost in rx buffer: %ld, dropped: %ld, garbage: %ld, unknown commands: %ld, incomplete messages: %ld\n",
+      rxOverflows, dropped, garbage, unknown, incomplete);
+    if (!latencies.empty()) {
+      std::vector<int32_t> l = latencies;
+      std::sort(l.begin(), l.end());
+      size_t n = l.size();
+      printf("request->line latency [mS]: min %.2f, 50%% %.2f, 90%% %.2f, 99%% %.2f, 99.9%% %.2f, max %.2f\n",
+        l[0]/1000.0, l[n*50/100]/1000.0, l[n*90/100]/1000.0, l[n*99/100]/1000.0, l[n*999/1000]/1000.0, l[n-1]/1000.0);
+      if (t>firstRequestTime) {
+        printf("throughput: %.1f lines/S\n", accepted*1e6/(t-firstRequestTime));
+      }
+    }
+    fflush(stdout);
+  }
+
+};
+
+
+static void usage(const char *aName)
+{
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -l ms     line period (time for one carriage pass), default 1000\n"
+    "  -j ms     max random deviation of the line period, default 0\n"
+    "  -r ms     time until carriage passes the left hall sensor (AYAB becomes ready), default 1000\n"
+    "  -d prob   probability for each byte to get lost (both directions), default 0\n"
+    "  -g prob   probability for garbage bytes before a message, default 0\n"
+    "  -F        fast: no 2S delay before first line\n"
+    "  -4        emulate API version 4 firmware (no line prefetch)\n"
+    "  -L path   create symlink to the pty at path\n"
+    "  -s seed   random seed (for reproducible runs), default 44\n"
+    "  -t sec    print statistics every sec seconds (also on SIGUSR1 and at exit)\n"
+    "  -v        verbose\n",
+    aName
+  );
+}
+
+
+int main(int argc, char **argv)
+{
+  AyabEmulator emu;
+  const char *linkPath = NULL;
+  unsigned seed = 44;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:j:r:d:g:F4L:s:t:vh"))!=-1) {
+    switch (opt) {
+      case 'l': emu.linePeriod = atof(optarg)*1000; break;
+      case 'j': emu.jitter = atof(optarg)*1000; break;
+      case 'r': emu.readyDelay = atof(optarg)*1000; break;
+      case 'd': emu.dropRate = atof(optarg); break;
+      case 'g': emu.garbageRate = atof(optarg); break;
+      case 'F': emu.fast = true; break;
+      case '4': emu.apiVersion = 4; break;
+      case 'L': linkPath = optarg; break;
+      case 's': seed = atoi(optarg); break;
+      case 't': emu.statsInterval = atof(optarg)*1000000; break;
+      case 'v': emu.verbose = true; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  srand(seed);
+  signal(SIGINT, terminationHandler);
+  signal(SIGTERM, terminationHandler);
+  signal(SIGUSR1, statsHandler);
+  int sfd = emu.openPty(linkPath);
+  if (sfd<0) return 1;
+  emu.run();
+  close(sfd);
+  if (linkPath) unlink(linkPath);
+  return 0;
+}
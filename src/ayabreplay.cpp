@@ -0,0 +1,282 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Replays a session recorded with p44ayabd --ayabcapture: plays the AYAB side of the capture on a pseudo terminal,
+// and checks that p44ayabd connected to it produces byte-identical line responses (and commands).
+// p44ayabd must start with the same queue state as the captured session (copy of the --statedir files).
+// Bytes from AYAB are sent in the same chunks as captured, either at the original timing, or (-f) as fast as
+// possible, i.e. as soon as p44ayabd has sent all messages that preceded them in the capture.
+// Usage: ayabreplay [-f] [-t timeout_ms] [-L linkpath] [-v] capturefile
+//   then: p44ayabd --ayabconnection /dev/pts/N ...
+// Exit status is 0 when all line responses matched.
+
+#include "ayabcapture.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+using namespace p44;
+
+#define FIRST_MESSAGE_TIMEOUT_US 60000000 // time p44ayabd may take to connect and send its first message
+#define DRAIN_TIME_US 500000 // time to wait for extra messages after the end of the capture
+#define MAX_REPORTED_DIFFS 10 // number of mismatches shown in detail (unless verbose)
+
+#define LINE_MSGID 0x42
+#define LINE_MSG_BYTES 29
+
+typedef int64_t USec;
+
+static USec now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (USec)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+
+/// @return size of messages from host to AYAB (API v4/v5), 0 for unknown message id
+static size_t hostMessageBytes(uint8_t aMsgId)
+{
+  switch (aMsgId) {
+    case 0x01: return 3; // reqStart
+    case 0x03: return 1; // reqInfo
+    case 0x04: return 1; // reqTest
+    case LINE_MSGID: return LINE_MSG_BYTES; // cnfLine
+    default: return 0;
+  }
+}
+
+
+static int fd = -1; // pty master
+static std::string rxBuf; // bytes from p44ayabd not yet processed
+static bool verbose = false;
+
+
+/// get next message from p44ayabd
+/// @param aMsg will receive the message
+/// @param aUntil max time to wait
+/// @return false on timeout
+static bool nextMessage(std::string &aMsg, USec aUntil)
+{
+  while (true) {
+    // check for complete message
+    while (!rxBuf.empty()) {
+      size_t n = hostMessageBytes(rxBuf[0]);
+      if (n==0) {
+        if (verbose) fprintf(stderr, "unknown byte 0x%02X from p44ayabd\n", (uint8_t)rxBuf[0]);
+        aMsg = rxBuf.substr(0, 1);
+        rxBuf.erase(0, 1);
+        return true;
+      }
+      if (rxBuf.size()<n) break;
+      aMsg = rxBuf.substr(0, n);
+      rxBuf.erase(0, n);
+      return true;
+    }
+    // need more bytes
+    USec t = now();
+    if (t>=aUntil) return false;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, (int)((aUntil-t+999)/1000))>0 && (pfd.revents & POLLIN)) {
+      char buf[256];
+      ssize_t res = read(fd, buf, sizeof(buf));
+      if (res>0) rxBuf.append(buf, res);
+    }
+  }
+}
+
+
+/// wait until aUntil, buffering what p44ayabd sends meanwhile
+static void waitUntil(USec aUntil)
+{
+  USec t;
+  while ((t = now())<aUntil) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, (int)((aUntil-t+999)/1000))>0 && (pfd.revents & POLLIN)) {
+      char buf[256];
+      ssize_t res = read(fd, buf, sizeof(buf));
+      if (res>0) rxBuf.append(buf, res);
+    }
+  }
+}
+
+
+static void showDiff(const char *aWhat, const std::string &aExpected, const std::string &aActual)
+{
+  fprintf(stderr, "%s differs:\n  expected:", aWhat);
+  for (size_t i=0; i<aExpected.size(); i++) fprintf(stderr, " %02X", (uint8_t)aExpected[i]);
+  fprintf(stderr, "\n  actual:  ");
+  for (size_t i=0; i<aActual.size(); i++) fprintf(stderr, " %02X", (uint8_t)aActual[i]);
+  fprintf(stderr, "\n");
+}
+
+
+static void usage(const char *aName)
+{
+  fprintf(stderr,
+    "Usage: %s [options] capturefile\n"
+    "  -f        fast: do not replay original timing, send as soon as p44ayabd has responded\n"
+    "  -t ms     timeout for each expected message from p44ayabd, default 5000\n"
+    "  -L path   create symlink to the pty at path\n"
+    "  -v        verbose\n",
+    aName
+  );
+}
+
+
+int main(int argc, char **argv)
+{
+  bool fast = false;
+  USec timeout = 5000000;
+  const char *linkPath = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "ft:L:vh"))!=-1) {
+    switch (opt) {
+      case 'f': fast = true; break;
+      case 't': timeout = atof(optarg)*1000; break;
+      case 'L': linkPath = optarg; break;
+      case 'v': verbose = true; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if (optind>=argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  AyabCaptureRecordVector records;
+  if (!readAyabCapture(argv[optind], records)) {
+    perror("cannot read capture file");
+    return 2;
+  }
+  if (records.empty()) {
+    fprintf(stderr, "capture file contains no records\n");
+    return 2;
+  }
+  // open pty, keep slave open so p44ayabd can close and re-open it
+  fd = posix_openpt(O_RDWR|O_NOCTTY);
+  if (fd<0 || grantpt(fd)<0 || unlockpt(fd)<0) {
+    perror("cannot open pseudo terminal");
+    return 2;
+  }
+  const char *slaveName = ptsname(fd);
+  int sfd = open(slaveName, O_RDWR|O_NOCTTY);
+  if (sfd<0) {
+    perror("cannot open pseudo terminal slave");
+    return 2;
+  }
+  struct termios t;
+  tcgetattr(sfd, &t);
+  cfmakeraw(&t);
+  tcsetattr(sfd, TCSANOW, &t);
+  if (linkPath) {
+    unlink(linkPath);
+    if (symlink(slaveName, linkPath)<0) perror("cannot create symlink");
+  }
+  printf("replaying %lu records from %s on %s%s%s\n", (unsigned long)records.size(), argv[optind], slaveName, linkPath ? " -> " : "", linkPath ? linkPath : "");
+  fflush(stdout);
+  // replay
+  long linesMatched = 0, linesDiffering = 0, linesMissing = 0;
+  long cmdsMatched = 0, cmdsDiffering = 0, cmdsMissing = 0;
+  long extra = 0;
+  long diffsShown = 0;
+  USec origin = records[0].time;
+  USec start = 0; // replay time corresponding to origin, set when first record is replayed
+  USec firstLine = 0;
+  USec lastLine = 0;
+  for (size_t i=0; i<records.size(); i++) {
+    const AyabCaptureRecord &r = records[i];
+    if (r.direction==AYAB_CAPTURE_TO_AYAB) {
+      // p44ayabd must send this now
+      bool isLine = (uint8_t)r.data[0]==LINE_MSGID;
+      std::string msg;
+      bool found = false;
+      while (nextMessage(msg, now()+(start ? timeout : FIRST_MESSAGE_TIMEOUT_US))) {
+        if (start==0) start = now()-(r.time-origin);
+        if (msg[0]==r.data[0]) {
+          found = true;
+          break;
+        }
+        // other message, e.g. additional poll or retry
+        extra++;
+        if (verbose) fprintf(stderr, "record %lu: extra message 0x%02X from p44ayabd\n", (unsigned long)i, (uint8_t)msg[0]);
+      }
+      if (!found) {
+        if (isLine) linesMissing++; else cmdsMissing++;
+        fprintf(stderr, "record %lu: p44ayabd did not send expected message 0x%02X\n", (unsigned long)i, (uint8_t)r.data[0]);
+        if (start==0) break; // p44ayabd not connected at all
+        continue;
+      }
+      bool same = msg==r.data;
+      if (isLine) {
+        if (same) linesMatched++; else linesDiffering++;
+        lastLine = now();
+        if (firstLine==0) firstLine = lastLine;
+      }
+      else {
+        if (same) cmdsMatched++; else cmdsDiffering++;
+      }
+      if (!same && (verbose || diffsShown++<MAX_REPORTED_DIFFS)) {
+        char what[60];
+        if (isLine) snprintf(what, sizeof(what), "record %lu: line response for row %d", (unsigned long)i, (uint8_t)r.data[1]);
+        else snprintf(what, sizeof(what), "record %lu: command 0x%02X", (unsigned long)i, (uint8_t)r.data[0]);
+        showDiff(what, r.data, msg);
+      }
+    }
+    else {
+      // from AYAB
+      if (start==0) start = now()-(r.time-origin);
+      if (!fast) waitUntil(start+(r.time-origin));
+      if (write(fd, r.data.data(), r.data.size())<0) {
+        perror("write");
+        break;
+      }
+    }
+  }
+  // anything else p44ayabd sends is extra
+  std::string msg;
+  while (nextMessage(msg, now()+DRAIN_TIME_US)) extra++;
+  // report
+  printf("line responses: %ld identical, %ld different, %ld missing\n", linesMatched, linesDiffering, linesMissing);
+  printf("commands: %ld identical, %ld different, %ld missing\n", cmdsMatched, cmdsDiffering, cmdsMissing);
+  printf("extra messages from p44ayabd: %ld\n", extra);
+  if (lastLine>firstLine) {
+    long lines = linesMatched+linesDiffering;
+    printf("replayed %ld lines in %.1f mS = %.1f lines/S (%s)\n", lines, (lastLine-firstLine)/1e3, (lines-1)*1e6/(lastLine-firstLine), fast ? "fast" : "original timing");
+  }
+  close(sfd);
+  close(fd);
+  if (linkPath) unlink(linkPath);
+  return linesDiffering==0 && linesMissing==0 ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "knitprogram.hpp"
+
+#include "patterncontainer.hpp"
+#include "needlepack.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+using namespace p44;
+
+
+#define KNITPROGRAM_MAGIC 0x5034344B // "K44P" when read as bytes on little endian
+#define KNITPROGRAM_VERSION 1
+
+// Note: program files are always created and read on the same machine, so no endianness conversion
+typedef struct {
+  uint32_t magic; ///< KNITPROGRAM_MAGIC
+  uint16_t version; ///< KNITPROGRAM_VERSION
+  uint16_t variants; ///< number of variants per row (1 for normal, 2 for ribber: plain and inverted)
+  int64_t generation; ///< content generation of the queue
+  uint32_t rows; ///< number of rows
+  int16_t width; ///< pattern width
+  int16_t shift; ///< pattern shift
+  int16_t firstNeedle; ///< first machine needle
+  uint8_t ribber; ///< ribber mode
+  uint8_t colors; ///< number of colors
+} KnitProgramHeader;
+
+
+KnitProgram::KnitProgram() :
+  programFd(-1),
+  programP(NULL),
+  programSize(0)
+{
+}
+
+
+KnitProgram::~KnitProgram()
+{
+  unmap();
+}
+
+
+void KnitProgram::unmap()
+{
+  if (programP) {
+    munmap(programP, programSize);
+    programP = NULL;
+  }
+  programSize = 0;
+  if (programFd>=0) {
+    close(programFd);
+    programFd = -1;
+  }
+}
+
+
+ErrorPtr KnitProgram::compile(const KnitProgramSource &aSource, const string aProgramFile)
+{
+  unmap();
+  if (aSource.width<1 || aSource.firstNeedle<0 || aSource.firstNeedle+aSource.width>KNITPROGRAM_ROW_BYTES*8) {
+    return TextError::err("Cannot compile knit program for width=%d at firstNeedle=%d", aSource.width, aSource.firstNeedle);
+  }
+  // prepare header
+  KnitProgramHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = KNITPROGRAM_MAGIC;
+  hdr.version = KNITPROGRAM_VERSION;
+  hdr.variants = aSource.ribber ? 2 : 1;
+  hdr.generation = aSource.generation;
+  hdr.width = aSource.width;
+  hdr.shift = aSource.shift;
+  hdr.firstNeedle = aSource.firstNeedle;
+  hdr.ribber = aSource.ribber;
+  hdr.colors = aSource.colors;
+  for (KnitProgramSource::EntryVector::const_iterator pos=aSource.entries.begin(); pos!=aSource.entries.end(); ++pos) {
+    hdr.rows += pos->patternLength;
+  }
+  // write into temp file first, so a valid old program is never half overwritten
+  string tempFile = aProgramFile + ".tmp";
+  FILE *f = fopen(tempFile.c_str(), "w");
+  if (!f) {
+    return SysError::errNo("Cannot create knit program file: ");
+  }
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, f)==1;
+  uint8_t rowBytes[2][KNITPROGRAM_ROW_BYTES];
+  uint8_t colorBits[KNITPROGRAM_ROW_BYTES];
+  for (KnitProgramSource::EntryVector::const_iterator pos=aSource.entries.begin(); ok && pos!=aSource.entries.end(); ++pos) {
+    PatternContainerPtr pattern = PatternContainerPtr(new PatternContainer);
+    if (pos->filepath.size()>0) {
+      ErrorPtr err = pattern->readPNGfromFile(pos->filepath.c_str());
+      if (!Error::isOK(err)) {
+        // same as when knitting directly: unreadable image just produces empty rows
+        LOG(LOG_WARNING, "Knit program: image cannot be read, compiling empty rows instead: %s", err->description().c_str());
+      }
+    }
+    else {
+      // just space
+      pattern->setSize(5, pos->patternLength);
+    }
+    for (int l=0; l<pos->patternLength; l++) {
+      memset(rowBytes, 0, sizeof(rowBytes));
+      // get entire knit row at once
+      // FIXME: only works for 2 colors and B&W input template
+      pattern->getPlaneRow(l, -aSource.shift, aSource.width, 0, colorBits);
+      // pattern is knitted in inverse direction: pattern needle y goes to machine needle firstNeedle+width-1-y
+      placeBits(colorBits, aSource.width, true, aSource.firstNeedle, rowBytes[0]);
+      if (hdr.variants>1) {
+        // inverted variant
+        for (int i=0; i<(aSource.width+7)/8; i++) colorBits[i] = ~colorBits[i];
+        placeBits(colorBits, aSource.width, true, aSource.firstNeedle, rowBytes[1]);
+      }
+      if (fwrite(rowBytes, KNITPROGRAM_ROW_BYTES, hdr.variants, f)!=hdr.variants) {
+        ok = false;
+        break;
+      }
+    }
+  }
+  if (fclose(f)!=0) ok = false;
+  if (!ok) {
+    ErrorPtr err = SysError::errNo("Error writing knit program file: ");
+    unlink(tempFile.c_str());
+    return err;
+  }
+  if (rename(tempFile.c_str(), aProgramFile.c_str())<0) {
+    return SysError::errNo("Cannot rename knit program file: ");
+  }
+  LOG(LOG_NOTICE, "Compiled knit program: %d rows, width=%d, shift=%d, firstNeedle=%d, ribber=%d", hdr.rows, hdr.width, hdr.shift, hdr.firstNeedle, hdr.ribber);
+  // now map it
+  return map(aProgramFile);
+}
+
+
+ErrorPtr KnitProgram::map(const string aProgramFile)
+{
+  unmap();
+  programFd = open(aProgramFile.c_str(), O_RDONLY);
+  if (programFd<0) {
+    return SysError::errNo("Cannot open knit program file: ");
+  }
+  struct stat st;
+  if (fstat(programFd, &st)<0) {
+    ErrorPtr err = SysError::errNo("Cannot stat knit program file: ");
+    unmap();
+    return err;
+  }
+  if (st.st_size<sizeof(KnitProgramHeader)) {
+    unmap();
+    return TextError::err("Knit program file too short");
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, programFd, 0);
+  if (p==MAP_FAILED) {
+    ErrorPtr err = SysError::errNo("Cannot map knit program file: ");
+    unmap();
+    return err;
+  }
+  programP = (uint8_t *)p;
+  programSize = st.st_size;
+  // verify
+  const KnitProgramHeader *hdr = (const KnitProgramHeader *)programP;
+  if (
+    hdr->magic!=KNITPROGRAM_MAGIC ||
+    hdr->version!=KNITPROGRAM_VERSION ||
+    programSize!=sizeof(KnitProgramHeader)+(size_t)hdr->rows*hdr->variants*KNITPROGRAM_ROW_BYTES
+  ) {
+    unmap();
+    return TextError::err("Invalid knit program file");
+  }
+  return ErrorPtr();
+}
+
+
+long KnitProgram::generation()
+{
+  if (!programP) return -1;
+  return (long)((const KnitProgramHeader *)programP)->generation;
+}
+
+
+int KnitProgram::rows()
+{
+  if (!programP) return 0;
+  return ((const KnitProgramHeader *)programP)->rows;
+}
+
+
+int KnitProgram::firstNeedle()
+{
+  if (!programP) return -1;
+  return ((const KnitProgramHeader *)programP)->firstNeedle;
+}
+
+
+const uint8_t *KnitProgram::needlesAt(int aRow, bool aInverted)
+{
+  if (!programP) return NULL;
+  const KnitProgramHeader *hdr = (const KnitProgramHeader *)programP;
+  if (aRow<0 || aRow>=hdr->rows) return NULL;
+  int variant = aInverted && hdr->variants>1 ? 1 : 0;
+  return programP+sizeof(KnitProgramHeader)+((size_t)aRow*hdr->variants+variant)*KNITPROGRAM_ROW_BYTES;
+}
@@ -0,0 +1,115 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44ayabd__knitprogram__
+#define __p44ayabd__knitprogram__
+
+#include "p44utils_common.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  #define KNITPROGRAM_ROW_BYTES 25 ///< 200 needles, one bit each, in AYAB line message order (first needle = bit0 of first byte)
+
+
+  /// snapshot of everything needed to compile a knit program from a pattern queue
+  class KnitProgramSource
+  {
+  public:
+
+    typedef struct {
+      string filepath; ///< PNG file, empty for space
+      int patternLength; ///< number of rows
+    } Entry;
+
+    typedef std::vector<Entry> EntryVector;
+
+    long generation; ///< content generation of the queue this source was taken from
+    int width; ///< pattern width in needles
+    int shift; ///< pattern shift
+    bool ribber; ///< ribber mode
+    int colors; ///< number of colors
+    int firstNeedle; ///< first machine needle used for the pattern
+    EntryVector entries; ///< the queue entries
+
+    KnitProgramSource() : generation(0), width(0), shift(0), ribber(false), colors(2), firstNeedle(0) {};
+  };
+
+
+
+  class KnitProgram;
+  typedef boost::intrusive_ptr<KnitProgram> KnitProgramPtr;
+
+  /// A knit program is the entire pattern queue compiled into ready-to-send needle bytes,
+  /// one row (or, in ribber mode, one plain and one inverted variant per row) after the other.
+  /// The program is written to a file and then mmap'd, so getting the needles for a row is just an index.
+  class KnitProgram : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    int programFd; ///< file descriptor of the mapped program file
+    uint8_t *programP; ///< the mapped program, NULL if none
+    size_t programSize; ///< size of the mapped program
+
+  public:
+
+    KnitProgram();
+    virtual ~KnitProgram();
+
+    /// compile a knit program into a file and map it
+    /// @param aSource snapshot of the pattern queue to compile
+    /// @param aProgramFile path of the program file to (re)create
+    /// @return ok or error
+    ErrorPtr compile(const KnitProgramSource &aSource, const string aProgramFile);
+
+    /// map an existing program file
+    /// @param aProgramFile path of the program file
+    /// @return ok or error
+    ErrorPtr map(const string aProgramFile);
+
+    /// unmap the current program, if any
+    void unmap();
+
+    /// @return true if a program is mapped
+    bool isValid() { return programP!=NULL; };
+
+    /// @return content generation of the queue the program was compiled from
+    long generation();
+
+    /// @return number of rows in the program
+    int rows();
+
+    /// @return first machine needle the program was compiled for
+    int firstNeedle();
+
+    /// get pre-packed needle bytes for a row
+    /// @param aRow row number (= cursor position within queue)
+    /// @param aInverted if set, get the inverted variant of the row (ribber phases)
+    /// @return pointer to KNITPROGRAM_ROW_BYTES needle bytes in AYAB line message order, NULL if row does not exist
+    const uint8_t *needlesAt(int aRow, bool aInverted);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44ayabd__knitprogram__) */
@@ -0,0 +1,143 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "latencyhistogram.hpp"
+
+using namespace p44;
+
+
+LatencyHistogram::LatencyHistogram(MLMicroSeconds aRollInterval) :
+  rollInterval(aRollInterval)
+{
+  reset();
+}
+
+
+void LatencyHistogram::reset()
+{
+  memset(windows, 0, sizeof(windows));
+  current = 0;
+  windowStart = Never;
+  totalCount = 0;
+}
+
+
+int LatencyHistogram::bucketFor(MLMicroSeconds aValue)
+{
+  if (aValue<0) aValue = 0;
+  if (aValue>0xFFFFFFFFll) aValue = 0xFFFFFFFFll;
+  uint32_t v = (uint32_t)aValue;
+  if (v<2*LATENCYHISTOGRAM_SUBBUCKETS) return v; // exact
+  int msb = 31-__builtin_clz(v);
+  int shift = msb-LATENCYHISTOGRAM_SUBBITS;
+  return shift*LATENCYHISTOGRAM_SUBBUCKETS+(v>>shift);
+}
+
+
+MLMicroSeconds LatencyHistogram::bucketUpperBound(int aBucket)
+{
+  if (aBucket<2*LATENCYHISTOGRAM_SUBBUCKETS) return aBucket; // exact
+  int shift = aBucket/LATENCYHISTOGRAM_SUBBUCKETS-1;
+  MLMicroSeconds m = aBucket%LATENCYHISTOGRAM_SUBBUCKETS+LATENCYHISTOGRAM_SUBBUCKETS;
+  return ((m+1)<<shift)-1;
+}
+
+
+void LatencyHistogram::roll(MLMicroSeconds aNow)
+{
+  if (windowStart==Never) {
+    windowStart = aNow;
+    return;
+  }
+  if (aNow-windowStart<rollInterval) return; // current window still running
+  // start new window, previous one remains in statistics only if it was just completed
+  if (aNow-windowStart>=2*rollInterval) {
+    memset(&windows[1-current], 0, sizeof(Window)); // both are outdated
+  }
+  current = 1-current;
+  memset(&windows[current], 0, sizeof(Window));
+  windowStart = aNow;
+}
+
+
+void LatencyHistogram::add(MLMicroSeconds aLatency, MLMicroSeconds aNow)
+{
+  roll(aNow);
+  Window &w = windows[current];
+  w.buckets[bucketFor(aLatency)]++;
+  w.count++;
+  w.sum += aLatency;
+  if (aLatency>w.max) w.max = aLatency;
+  totalCount++;
+}
+
+
+long LatencyHistogram::count()
+{
+  return windows[0].count+windows[1].count;
+}
+
+
+MLMicroSeconds LatencyHistogram::average()
+{
+  long n = count();
+  return n>0 ? (windows[0].sum+windows[1].sum)/n : 0;
+}
+
+
+MLMicroSeconds LatencyHistogram::maximum()
+{
+  return windows[0].max>windows[1].max ? windows[0].max : windows[1].max;
+}
+
+
+MLMicroSeconds LatencyHistogram::percentile(double aPercentile)
+{
+  long n = count();
+  if (n==0) return 0;
+  long rank = (long)(aPercentile*n/100+0.5); // number of values that must be at or below the result
+  if (rank<1) rank = 1;
+  long seen = 0;
+  for (int i=0; i<LATENCYHISTOGRAM_BUCKETS; i++) {
+    seen += windows[0].buckets[i]+windows[1].buckets[i];
+    if (seen>=rank) {
+      MLMicroSeconds b = bucketUpperBound(i);
+      MLMicroSeconds m = maximum();
+      return b<m ? b : m; // no need to report more than actual max
+    }
+  }
+  return maximum();
+}
+
+
+JsonObjectPtr LatencyHistogram::statsJSON()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  s->add("count", JsonObject::newInt64(count()));
+  s->add("total", JsonObject::newInt64(totalCount));
+  s->add("avgUS", JsonObject::newInt64(average()));
+  s->add("p50US", JsonObject::newInt64(percentile(50)));
+  s->add("p95US", JsonObject::newInt64(percentile(95)));
+  s->add("p99US", JsonObject::newInt64(percentile(99)));
+  s->add("maxUS", JsonObject::newInt64(maximum()));
+  return s;
+}
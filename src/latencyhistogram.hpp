@@ -0,0 +1,95 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44ayabd__latencyhistogram__
+#define __p44ayabd__latencyhistogram__
+
+#include "p44utils_common.hpp"
+
+#include "jsonobject.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  #define LATENCYHISTOGRAM_SUBBITS 4 ///< 16 sub-buckets per power of two = max 6.25% error
+  #define LATENCYHISTOGRAM_SUBBUCKETS (1<<LATENCYHISTOGRAM_SUBBITS)
+  #define LATENCYHISTOGRAM_BUCKETS ((32-LATENCYHISTOGRAM_SUBBITS+1)*LATENCYHISTOGRAM_SUBBUCKETS) ///< covers 0..2^32-1 uS
+
+  /// HDR-style histogram of latencies with logarithmic buckets, linear within each power of two.
+  /// Rolling: values are collected in two alternating windows, statistics cover the current and the previous window.
+  /// @note fixed size, does not allocate when adding values
+  class LatencyHistogram
+  {
+    typedef struct {
+      uint32_t buckets[LATENCYHISTOGRAM_BUCKETS];
+      long count;
+      MLMicroSeconds sum;
+      MLMicroSeconds max;
+    } Window;
+
+    Window windows[2];
+    int current; ///< index of current window
+    MLMicroSeconds windowStart; ///< when current window was started
+    MLMicroSeconds rollInterval; ///< length of a window
+    long totalCount; ///< all values ever added
+
+  public:
+
+    /// @param aRollInterval length of a window
+    LatencyHistogram(MLMicroSeconds aRollInterval = 60*Second);
+
+    /// clear all values
+    void reset();
+
+    /// add a value
+    /// @param aLatency the latency
+    /// @param aNow current time (to roll windows)
+    void add(MLMicroSeconds aLatency, MLMicroSeconds aNow);
+
+    /// @return number of values in current and previous window
+    long count();
+
+    /// @return average of values in current and previous window
+    MLMicroSeconds average();
+
+    /// @return max of values in current and previous window
+    MLMicroSeconds maximum();
+
+    /// @param aPercentile percentile (0..100)
+    /// @return upper bound of the bucket containing the percentile of values in current and previous window
+    MLMicroSeconds percentile(double aPercentile);
+
+    /// @return statistics (count, avg, p50, p95, p99, max in microseconds) as JSON
+    JsonObjectPtr statsJSON();
+
+  private:
+
+    static int bucketFor(MLMicroSeconds aValue);
+    static MLMicroSeconds bucketUpperBound(int aBucket);
+    void roll(MLMicroSeconds aNow);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44ayabd__latencyhistogram__) */
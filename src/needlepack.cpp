@@ -0,0 +1,305 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "needlepack.hpp"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+#endif
+
+using namespace p44;
+
+#define MAX_PLACE_BYTES 32 // max 256 bits can be placed at once
+
+
+static const uint8_t bitReverseTable[256] = {
+  0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+  0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+  0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+  0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+  0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+  0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+  0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+  0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+  0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+  0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+  0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+  0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+  0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+  0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+  0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+  0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff
+};
+
+
+#pragma mark - threshold and pack
+
+void p44::thresholdAndPackScalar(const uint8_t *aValues, size_t aNumValues, uint8_t aThreshold, bool aAbove, uint8_t *aBits)
+{
+  for (size_t i=0; i<aNumValues; i+=8) {
+    uint8_t b = 0;
+    size_t n = aNumValues-i<8 ? aNumValues-i : 8;
+    for (size_t k=0; k<n; k++) {
+      if ((aValues[i+k]>aThreshold)==aAbove) b |= (1<<k);
+    }
+    *aBits++ = b;
+  }
+}
+
+
+void p44::thresholdAndPack(const uint8_t *aValues, size_t aNumValues, uint8_t aThreshold, bool aAbove, uint8_t *aBits)
+{
+  size_t done = 0;
+  if (aAbove && aThreshold==255) {
+    // no value can be above
+    memset(aBits, 0, (aNumValues+7)>>3);
+    return;
+  }
+  #if defined(__AVX2__)
+  // 32 values at once
+  // Note: no unsigned compare, so v>t is max(v,t+1)==v, and v<=t is min(v,t)==v
+  __m256i t = _mm256_set1_epi8((char)(aAbove ? aThreshold+1 : aThreshold));
+  for (; done+32<=aNumValues; done+=32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(aValues+done));
+    __m256i m = _mm256_cmpeq_epi8(aAbove ? _mm256_max_epu8(v, t) : _mm256_min_epu8(v, t), v);
+    uint32_t bits = (uint32_t)_mm256_movemask_epi8(m);
+    aBits[0] = bits & 0xFF;
+    aBits[1] = (bits>>8) & 0xFF;
+    aBits[2] = (bits>>16) & 0xFF;
+    aBits[3] = (bits>>24) & 0xFF;
+    aBits += 4;
+  }
+  #elif defined(__SSE2__)
+  // 16 values at once
+  // Note: no unsigned compare, so v>t is max(v,t+1)==v, and v<=t is min(v,t)==v
+  __m128i t = _mm_set1_epi8((char)(aAbove ? aThreshold+1 : aThreshold));
+  for (; done+16<=aNumValues; done+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(aValues+done));
+    __m128i m = _mm_cmpeq_epi8(aAbove ? _mm_max_epu8(v, t) : _mm_min_epu8(v, t), v);
+    int bits = _mm_movemask_epi8(m);
+    aBits[0] = bits & 0xFF;
+    aBits[1] = (bits>>8) & 0xFF;
+    aBits += 2;
+  }
+  #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  // 16 values at once
+  // Note: no movemask on NEON, so compare results are masked with bit weights and summed up pairwise
+  static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  uint8x16_t w = vld1q_u8(weights);
+  uint8x16_t t = vdupq_n_u8(aThreshold);
+  for (; done+16<=aNumValues; done+=16) {
+    uint8x16_t v = vld1q_u8(aValues+done);
+    uint8x16_t m = vandq_u8(aAbove ? vcgtq_u8(v, t) : vcleq_u8(v, t), w);
+    uint8x8_t s = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+    s = vpadd_u8(s, s);
+    s = vpadd_u8(s, s);
+    aBits[0] = vget_lane_u8(s, 0);
+    aBits[1] = vget_lane_u8(s, 1);
+    aBits += 2;
+  }
+  #endif
+  // rest (or all, if no SIMD kernel)
+  thresholdAndPackScalar(aValues+done, aNumValues-done, aThreshold, aAbove, aBits);
+}
+
+
+#pragma mark - placing bits
+
+/// get 8 bits starting at any bit position
+static inline uint8_t bitsAt(const uint8_t *aBits, size_t aBitPos, size_t aNumBytes)
+{
+  size_t i = aBitPos>>3;
+  int sh = aBitPos & 0x07;
+  uint8_t b = aBits[i]>>sh;
+  if (sh && i+1<aNumBytes) b |= aBits[i+1]<<(8-sh);
+  return b;
+}
+
+
+/// OR aNumBits from any bit position in aSrc into any bit position in aDst, bytewise
+static void orBits(const uint8_t *aSrc, size_t aSrcBit, size_t aSrcBytes, size_t aNumBits, uint8_t *aDst, size_t aDstBit)
+{
+  uint8_t *d = aDst+(aDstBit>>3);
+  int dsh = aDstBit & 0x07;
+  uint8_t *e = aDst+((aDstBit+aNumBits+7)>>3); // end of destination
+  for (size_t n=0; n<aNumBits; n+=8) {
+    uint8_t b = bitsAt(aSrc, aSrcBit+n, aSrcBytes);
+    if (aNumBits-n<8) b &= (1<<(aNumBits-n))-1; // last partial byte
+    *d |= b<<dsh;
+    if (dsh && d+1<e) *(d+1) |= b>>(8-dsh);
+    d++;
+  }
+}
+
+
+void p44::placeBits(const uint8_t *aBits, size_t aNumBits, bool aReverse, int aFirstNeedle, uint8_t *aNeedles)
+{
+  if (aNumBits==0) return;
+  size_t nb = (aNumBits+7)>>3;
+  if (!aReverse) {
+    orBits(aBits, 0, nb, aNumBits, aNeedles, aFirstNeedle);
+  }
+  else {
+    // reverse entire bit vector: reverse byte order and bits within bytes
+    if (nb>MAX_PLACE_BYTES) nb = MAX_PLACE_BYTES;
+    uint8_t rev[MAX_PLACE_BYTES];
+    for (size_t i=0; i<nb; i++) {
+      rev[i] = bitReverseTable[aBits[nb-1-i]];
+    }
+    // unused bits of the last source byte are now at the beginning
+    orBits(rev, nb*8-aNumBits, nb, aNumBits, aNeedles, aFirstNeedle);
+  }
+}
+
+
+void p44::packNeedles(const uint8_t *aValues, size_t aNumValues, uint8_t aThreshold, bool aAbove, bool aReverse, int aFirstNeedle, uint8_t *aNeedles)
+{
+  uint8_t bits[MAX_PLACE_BYTES];
+  if (aNumValues>MAX_PLACE_BYTES*8) aNumValues = MAX_PLACE_BYTES*8;
+  thresholdAndPack(aValues, aNumValues, aThreshold, aAbove, bits);
+  placeBits(bits, aNumValues, aReverse, aFirstNeedle, aNeedles);
+}
+
+
+
+#pragma mark - NeedleMask
+
+
+static inline uint32_t reverse32(uint32_t aWord)
+{
+  aWord = ((aWord>>1) & 0x55555555) | ((aWord & 0x55555555)<<1);
+  aWord = ((aWord>>2) & 0x33333333) | ((aWord & 0x33333333)<<2);
+  aWord = ((aWord>>4) & 0x0F0F0F0F) | ((aWord & 0x0F0F0F0F)<<4);
+  aWord = ((aWord>>8) & 0x00FF00FF) | ((aWord & 0x00FF00FF)<<8);
+  return (aWord>>16) | (aWord<<16);
+}
+
+
+void NeedleMask::clear()
+{
+  memset(words, 0, sizeof(words));
+}
+
+
+void NeedleMask::maskAbove(int aNumBits)
+{
+  for (int w=0; w<NEEDLEMASK_WORDS; w++) {
+    int n = aNumBits-w*32; // bits to keep in this word
+    if (n<=0) words[w] = 0;
+    else if (n<32) words[w] &= (1u<<n)-1;
+  }
+}
+
+
+void NeedleMask::setBits(const uint8_t *aBits, size_t aNumBits)
+{
+  if (aNumBits>NEEDLEMASK_BITS) aNumBits = NEEDLEMASK_BITS;
+  size_t nb = (aNumBits+7)>>3;
+  clear();
+  for (size_t i=0; i<nb; i++) {
+    words[i>>2] |= (uint32_t)aBits[i]<<((i & 0x03)*8);
+  }
+  maskAbove((int)aNumBits);
+}
+
+
+void NeedleMask::getBytes(uint8_t *aBytes, size_t aNumBytes) const
+{
+  if (aNumBytes>NEEDLEMASK_WORDS*4) aNumBytes = NEEDLEMASK_WORDS*4;
+  for (size_t i=0; i<aNumBytes; i++) {
+    aBytes[i] = (uint8_t)(words[i>>2]>>((i & 0x03)*8));
+  }
+}
+
+
+void NeedleMask::shift(int aShift)
+{
+  if (aShift==0) return;
+  if (aShift>=NEEDLEMASK_BITS || aShift<=-NEEDLEMASK_BITS) {
+    clear();
+    return;
+  }
+  int ws = (aShift>0 ? aShift : -aShift)>>5; // whole words
+  int bs = (aShift>0 ? aShift : -aShift) & 0x1F; // bits
+  uint32_t r[NEEDLEMASK_WORDS];
+  for (int w=0; w<NEEDLEMASK_WORDS; w++) {
+    uint32_t v = 0;
+    if (aShift>0) {
+      int s = w-ws;
+      if (s>=0) v = words[s]<<bs;
+      if (bs && s-1>=0) v |= words[s-1]>>(32-bs);
+    }
+    else {
+      int s = w+ws;
+      if (s<NEEDLEMASK_WORDS) v = words[s]>>bs;
+      if (bs && s+1<NEEDLEMASK_WORDS) v |= words[s+1]<<(32-bs);
+    }
+    r[w] = v;
+  }
+  memcpy(words, r, sizeof(words));
+}
+
+
+void NeedleMask::reverse(int aNumBits)
+{
+  if (aNumBits>NEEDLEMASK_BITS) aNumBits = NEEDLEMASK_BITS;
+  if (aNumBits<=0) {
+    clear();
+    return;
+  }
+  maskAbove(aNumBits);
+  // reverse entire mask: needle n becomes NEEDLEMASK_BITS-1-n
+  for (int i=0; i<NEEDLEMASK_WORDS/2; i++) {
+    uint32_t t = reverse32(words[i]);
+    words[i] = reverse32(words[NEEDLEMASK_WORDS-1-i]);
+    words[NEEDLEMASK_WORDS-1-i] = t;
+  }
+  if (NEEDLEMASK_WORDS & 1) {
+    words[NEEDLEMASK_WORDS/2] = reverse32(words[NEEDLEMASK_WORDS/2]);
+  }
+  // move down so needle n becomes aNumBits-1-n
+  shift(aNumBits-NEEDLEMASK_BITS);
+}
+
+
+void NeedleMask::invert(int aNumBits)
+{
+  if (aNumBits>NEEDLEMASK_BITS) aNumBits = NEEDLEMASK_BITS;
+  for (int w=0; w<NEEDLEMASK_WORDS; w++) {
+    int n = aNumBits-w*32; // bits to invert in this word
+    if (n<=0) break;
+    words[w] ^= n<32 ? (1u<<n)-1 : 0xFFFFFFFF;
+  }
+}
+
+
+void NeedleMask::orWith(const NeedleMask &aMask)
+{
+  for (int w=0; w<NEEDLEMASK_WORDS; w++) {
+    words[w] |= aMask.words[w];
+  }
+}
@@ -0,0 +1,118 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44ayabd__needlepack__
+#define __p44ayabd__needlepack__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Note: kernel variant is selected at compile time according to what the compiler targets
+//   (-mavx2 for AVX2, SSE2 is default on x86_64, -mfpu=neon on ARM). Pi B/B+ (ARMv6) uses scalar.
+#if defined(__AVX2__)
+  #define NEEDLEPACK_KERNEL "AVX2"
+#elif defined(__SSE2__)
+  #define NEEDLEPACK_KERNEL "SSE2"
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #define NEEDLEPACK_KERNEL "NEON"
+#else
+  #define NEEDLEPACK_KERNEL "scalar"
+#endif
+
+namespace p44 {
+
+  /// threshold values and pack results into bits
+  /// @param aValues values to check
+  /// @param aNumValues number of values
+  /// @param aThreshold threshold
+  /// @param aAbove if set, bit is set for values > aThreshold, otherwise for values <= aThreshold
+  /// @param aBits where to store the bits, (aNumValues+7)/8 bytes, first value in bit0 of first byte, unused bits of last byte are zero
+  void thresholdAndPack(const uint8_t *aValues, size_t aNumValues, uint8_t aThreshold, bool aAbove, uint8_t *aBits);
+
+  /// same as thresholdAndPack(), but always using plain C code (reference and tail processing)
+  void thresholdAndPackScalar(const uint8_t *aValues, size_t aNumValues, uint8_t aThreshold, bool aAbove, uint8_t *aBits);
+
+  /// OR packed bits into needle bytes at a bit offset, optionally in reverse order
+  /// @param aBits packed bits, first in bit0 of first byte
+  /// @param aNumBits number of bits
+  /// @param aReverse if set, bit i goes to needle aFirstNeedle+aNumBits-1-i, otherwise to aFirstNeedle+i
+  /// @param aFirstNeedle bit offset in aNeedles
+  /// @param aNeedles needle bytes, first needle in bit0 of first byte. Must be large enough for aFirstNeedle+aNumBits bits
+  void placeBits(const uint8_t *aBits, size_t aNumBits, bool aReverse, int aFirstNeedle, uint8_t *aNeedles);
+
+  /// threshold values, and OR results directly into needle bytes at a bit offset, optionally in reverse order
+  /// @note combination of thresholdAndPack() and placeBits(), for max 256 values
+  void packNeedles(const uint8_t *aValues, size_t aNumValues, uint8_t aThreshold, bool aAbove, bool aReverse, int aFirstNeedle, uint8_t *aNeedles);
+
+
+  #define NEEDLEMASK_WORDS 7 ///< 224 bits, enough for 200 needles
+  #define NEEDLEMASK_BITS (NEEDLEMASK_WORDS*32)
+
+  /// fixed size packed needle mask, operating on whole 32-bit words.
+  /// Needle n is bit n%32 of word n/32. Plain value type, meant to live on the stack.
+  class NeedleMask
+  {
+  public:
+
+    uint32_t words[NEEDLEMASK_WORDS];
+
+    NeedleMask() { clear(); };
+
+    /// clear all needles
+    void clear();
+
+    /// load packed bits
+    /// @param aBits packed bits, first needle in bit0 of first byte
+    /// @param aNumBits number of bits to load, all other needles are cleared
+    void setBits(const uint8_t *aBits, size_t aNumBits);
+
+    /// store as packed bytes
+    /// @param aBytes where to store the bytes, first needle in bit0 of first byte
+    /// @param aNumBytes number of bytes to store
+    void getBytes(uint8_t *aBytes, size_t aNumBytes) const;
+
+    /// shift needles
+    /// @param aShift positive: needle n moves to n+aShift, negative: needle n moves to n-aShift. Needles shifted out are lost
+    void shift(int aShift);
+
+    /// reverse order of needles
+    /// @param aNumBits needle n becomes needle aNumBits-1-n. Needles at aNumBits and above are lost
+    void reverse(int aNumBits);
+
+    /// invert needles
+    /// @param aNumBits number of needles to invert, starting at needle 0
+    void invert(int aNumBits);
+
+    /// OR in another mask
+    void orWith(const NeedleMask &aMask);
+
+    /// @return true if needle is set
+    bool isSet(int aNeedle) const { return aNeedle>=0 && aNeedle<NEEDLEMASK_BITS && (words[aNeedle>>5]>>(aNeedle & 0x1F)) & 1; };
+
+  private:
+
+    void maskAbove(int aNumBits);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44ayabd__needlepack__) */
@@ -0,0 +1,119 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Microbenchmark for the needle packing kernels: compares the kernel selected at compile time
+// with the plain C version and with the per-pixel/per-bit loops used before.
+// Usage: needlepackbench [rows [width]]
+
+#include "needlepack.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace p44;
+
+#define NEEDLE_BYTES 25
+
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+// as in PatternQueue::colorNoAtCursor before bitplanes: per pixel threshold
+static void perPixelThreshold(const uint8_t *aValues, int aNum, uint8_t aThreshold, uint8_t *aBits)
+{
+  memset(aBits, 0, (aNum+7)/8);
+  for (int i=0; i<aNum; i++) {
+    if (aValues[i]>aThreshold) aBits[i>>3] |= (1<<(i & 0x07));
+  }
+}
+
+
+// as in AyabComm::sendNextRow before: one bit at a time, in inverse direction, at firstNeedle offset
+static void perBitPlace(const uint8_t *aValues, int aNum, uint8_t aThreshold, int aFirstNeedle, uint8_t *aNeedles)
+{
+  for (int i=0; i<aNum; i++) {
+    if (aValues[aNum-1-i]>aThreshold) {
+      int j = i+aFirstNeedle;
+      aNeedles[j>>3] |= (0x01 << (j & 0x07));
+    }
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  int rows = argc>1 ? atoi(argv[1]) : 100000;
+  int width = argc>2 ? atoi(argv[2]) : 180;
+  if (rows<1 || width<1 || width>200) {
+    fprintf(stderr, "Usage: %s [rows [width (1..200)]]\n", argv[0]);
+    return 1;
+  }
+  int firstNeedle = 100-width/2;
+  // random gray rows
+  uint8_t *gray = new uint8_t[(size_t)rows*width];
+  srand(44);
+  for (size_t i=0; i<(size_t)rows*width; i++) gray[i] = rand() & 0xFF;
+  uint8_t *out1 = new uint8_t[(size_t)rows*NEEDLE_BYTES];
+  uint8_t *out2 = new uint8_t[(size_t)rows*NEEDLE_BYTES];
+  double t;
+  printf("needle packing benchmark: %d rows of %d needles, kernel = %s\n", rows, width, NEEDLEPACK_KERNEL);
+  // threshold and pack only
+  memset(out1, 0, (size_t)rows*NEEDLE_BYTES);
+  memset(out2, 0, (size_t)rows*NEEDLE_BYTES);
+  t = now();
+  for (int r=0; r<rows; r++) perPixelThreshold(gray+(size_t)r*width, width, 128, out1+(size_t)r*NEEDLE_BYTES);
+  double tPixel = now()-t;
+  t = now();
+  for (int r=0; r<rows; r++) thresholdAndPackScalar(gray+(size_t)r*width, width, 128, true, out2+(size_t)r*NEEDLE_BYTES);
+  double tScalar = now()-t;
+  bool okScalar = memcmp(out1, out2, (size_t)rows*NEEDLE_BYTES)==0;
+  memset(out2, 0, (size_t)rows*NEEDLE_BYTES);
+  t = now();
+  for (int r=0; r<rows; r++) thresholdAndPack(gray+(size_t)r*width, width, 128, true, out2+(size_t)r*NEEDLE_BYTES);
+  double tKernel = now()-t;
+  bool okKernel = memcmp(out1, out2, (size_t)rows*NEEDLE_BYTES)==0;
+  printf("threshold+pack  per pixel: %8.1f ns/row\n", tPixel*1e9/rows);
+  printf("threshold+pack     scalar: %8.1f ns/row  %s\n", tScalar*1e9/rows, okScalar ? "ok" : "MISMATCH");
+  printf("threshold+pack %11s: %8.1f ns/row  %s\n", NEEDLEPACK_KERNEL, tKernel*1e9/rows, okKernel ? "ok" : "MISMATCH");
+  // threshold, reverse and place at needle offset
+  memset(out1, 0, (size_t)rows*NEEDLE_BYTES);
+  memset(out2, 0, (size_t)rows*NEEDLE_BYTES);
+  t = now();
+  for (int r=0; r<rows; r++) perBitPlace(gray+(size_t)r*width, width, 128, firstNeedle, out1+(size_t)r*NEEDLE_BYTES);
+  double tBit = now()-t;
+  t = now();
+  for (int r=0; r<rows; r++) packNeedles(gray+(size_t)r*width, width, 128, true, true, firstNeedle, out2+(size_t)r*NEEDLE_BYTES);
+  double tPack = now()-t;
+  bool okPack = memcmp(out1, out2, (size_t)rows*NEEDLE_BYTES)==0;
+  printf("reverse+place     per bit: %8.1f ns/row\n", tBit*1e9/rows);
+  printf("reverse+place %12s: %8.1f ns/row  %s\n", NEEDLEPACK_KERNEL, tPack*1e9/rows, okPack ? "ok" : "MISMATCH");
+  delete[] gray;
+  delete[] out1;
+  delete[] out2;
+  return okScalar && okKernel && okPack ? 0 : 2;
+}
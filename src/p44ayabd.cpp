@@ -25,13 +25,21 @@
 #include "patternqueue.hpp"
 #include "jsoncomm.hpp"
 
+#include <sys/resource.h>
+
 using namespace p44;
 
 #define DEFAULT_LOGLEVEL LOG_NOTICE
 #define DEFAULT_STATE_DIR "/tmp"
+#define KNIT_PROGRAM_FILE_NAME "p44ayabd_knitprogram.bin"
 
 #define MAINLOOP_CYCLE_TIME_uS 33333 // 33mS
 
+#define BENCHMARK_WIDTH 120 // needles used for synthetic benchmark pattern
+#define BENCHMARK_SEGMENT_ROWS 200 // rows per queue entry of the synthetic benchmark pattern
+#define BENCHMARK_PNG_FILE_NAME "p44ayabd_benchmark.png"
+#define BENCHMARK_REST_PNG_FILE_NAME "p44ayabd_benchmark_rest.png"
+
 
 
 class P44ayabd : public CmdLineApp
@@ -41,20 +49,32 @@ class P44ayabd : public CmdLineApp
   AyabCommPtr ayabComm;
 
   bool apiMode; ///< set if in API mode (means working as daemon, not quitting when job is done)
+  bool benchmarkMode; ///< set if in benchmark mode (knitting without AYAB as fast as possible, then report and quit)
   // API Server
   SocketCommPtr apiServer;
 
   PatternQueuePtr patternQueue;
+  KnitProgramPtr knitProgram;
   string statedir;
 
+  // background knit program compiler
+  ChildThreadWrapperPtr compileThread; ///< compiler thread, set while compiling
+  KnitProgramPtr compilingProgram; ///< the program being compiled
+  KnitProgramSource compileSource; ///< queue snapshot the program is compiled from
+  ErrorPtr compileErr; ///< compile result, only valid after compiler thread has completed
+  SimpleCB programReadyCB; ///< called once when the compiler has finished and the program is up to date (or cannot be compiled)
+
   long initiateTicket;
+  long programTicket;
   bool firstPhase;
 
 public:
 
   P44ayabd() :
     apiMode(false),
-    initiateTicket(0)
+    benchmarkMode(false),
+    initiateTicket(0),
+    programTicket(0)
   {
   };
 
@@ -70,6 +90,14 @@ public:
       { 0  , "knitpng",         true,  "png_file;simple mode: just knit specified PNG file and then exit" },
       { 0  , "ayabconnection",  true,  "serial_if;serial interface where AYAB is connected (/device or IP:port - or 'simulation' for test w/o actual AYAB)" },
       { 0  , "statedir",        true,  "path;writable directory where to store state information. Defaults to " DEFAULT_STATE_DIR },
+      { 0  , "cachebudget",     true,  "bytes;max memory for decoded patterns kept in advance. Defaults to 8388608 (8MB)" },
+      { 0  , "prefetch",        true,  "entries;number of queue entries after the current one to decode in advance. Defaults to 2" },
+      { 0  , "lookahead",       true,  "rows;number of rows to render in advance, ready to send when requested by AYAB. Defaults to 8, 0 = disabled" },
+      { 0  , "nolineprefetch",  false, "do not let AYAB (firmware API version 5) request rows in advance, so changes to the pattern take effect with the next row" },
+      { 0  , "serialthread",    true,  "priority;serve AYAB line requests from a dedicated thread. 0 = normal scheduling, 1..99 = SCHED_FIFO realtime priority (needs root)" },
+      { 0  , "ayabcapture",     true,  "path;append all serial traffic with AYAB to a capture file, for replaying with ayabreplay" },
+      { 0  , "benchmark",       true,  "rows;knit the queue (or the --knitpng file) without AYAB as fast as possible, print throughput report and exit. "
+                                       "If there is nothing to knit, a synthetic pattern with the specified number of rows is used (written as PNG files to the state dir)" },
       { 'h', "help",            false, "show this text" },
       { 0, NULL } // list terminator
     };
@@ -106,18 +134,51 @@ public:
     // get AYAB connection
     // - set interface
     string ayabconnection;
-    if (getStringOption("ayabconnection", ayabconnection)) {
+    benchmarkMode = getOption("benchmark");
+    if (benchmarkMode || getStringOption("ayabconnection", ayabconnection)) {
       ayabComm = AyabCommPtr(new AyabComm(MainLoop::currentMainLoop()));
-      ayabComm->setConnectionSpecification(ayabconnection.c_str(), 2109);
+      if (benchmarkMode) {
+        ayabComm->setBenchmarkMode(boost::bind(&P44ayabd::benchmarkDone, this));
+      }
+      else {
+        ayabComm->setConnectionSpecification(ayabconnection.c_str(), 2109);
+        string capturefile;
+        if (getStringOption("ayabcapture", capturefile)) {
+          err = ayabComm->setCaptureFile(capturefile.c_str());
+          if (!Error::isOK(err)) {
+            LOG(LOG_ERR, "%s", err->description().c_str());
+          }
+        }
+      }
+      int lookahead = AYAB_DEFAULT_LOOKAHEAD;
+      getIntOption("lookahead", lookahead);
+      ayabComm->setLookahead(lookahead, boost::bind(&P44ayabd::peekRow, this, _1, _2), boost::bind(&P44ayabd::advanceRow, this));
+      if (getOption("nolineprefetch")) {
+        ayabComm->setLinePrefetch(false);
+      }
+      int serialThreadPriority;
+      if (getIntOption("serialthread", serialThreadPriority)) {
+        ayabComm->startSerialThread(serialThreadPriority);
+      }
     }
     else {
       terminateAppWith(TextError::err("no connection specified for AYAB"));
     }
     // create queue
     patternQueue = PatternQueuePtr(new PatternQueue);
+    int cacheBudget = DEFAULT_PATTERN_CACHE_BUDGET;
+    getIntOption("cachebudget", cacheBudget);
+    int cacheLookahead = DEFAULT_PATTERN_CACHE_LOOKAHEAD;
+    getIntOption("prefetch", cacheLookahead);
+    patternQueue->setCacheParams(cacheBudget, cacheLookahead);
+    knitProgram = KnitProgramPtr(new KnitProgram);
     // check mode
     string p;
-    if (getStringOption("knitpng", p)) {
+    int rows;
+    if (getIntOption("benchmark", rows)) {
+      benchmarkModeStart(rows);
+    }
+    else if (getStringOption("knitpng", p)) {
       ayabComm->restart(boost::bind(&P44ayabd::simpleModeStart, this, p));
     }
     else if (getStringOption("jsonapiport", p)) {
@@ -125,7 +186,7 @@ public:
     }
     else {
       // unknown mode
-      terminateAppWith(TextError::err("Must use either --knitpng or --jsonapiport"));
+      terminateAppWith(TextError::err("Must use either --knitpng, --jsonapiport or --benchmark"));
     }
   };
 
@@ -215,6 +276,7 @@ public:
     else if (aUri=="/machine") {
       if (aIsAction) {
         bool needsRestart = false;
+        bool needsReconfig = false;
         bool foundAction = false;
         if (aData->get("restart", o)) {
           foundAction = true;
@@ -225,32 +287,36 @@ public:
         if (aData->get("setWidth", o)) {
           foundAction = true;
           err = patternQueue->setWidth(o->int32Value());
-          // also needs restart
-          needsRestart = true;
+          // running job must be reconfigured
+          needsReconfig = true;
         }
         if (aData->get("setShift", o)) {
           foundAction = true;
           err = patternQueue->setShift(o->int32Value());
-          // also needs restart
-          needsRestart = true;
+          // running job must be reconfigured
+          needsReconfig = true;
         }
         if (aData->get("setRibber", o)) {
           foundAction = true;
           err = patternQueue->setRibberMode(o->boolValue());
-          // also needs restart
-          needsRestart = true;
+          // running job must be reconfigured
+          needsReconfig = true;
         }
         if (aData->get("setColors", o)) {
           foundAction = true;
           err = patternQueue->setColors(o->int32Value());
-          // also needs restart
-          needsRestart = true;
+          // running job must be reconfigured
+          needsReconfig = true;
         }
         if (foundAction) {
+          ayabComm->invalidateLookahead();
           patternQueue->saveState(statedir.c_str(), false);
           if (needsRestart) {
             restartAyab(true);
           }
+          else if (needsReconfig) {
+            reconfigureKnitting();
+          }
         }
         else {
           err = WebError::webErr(500, "Unknown action for /machine");
@@ -259,6 +325,7 @@ public:
       else {
         o = JsonObject::newObj();
         o->add("status", JsonObject::newInt32(ayabComm->getStatus()));
+        o->add("rows", ayabComm->rowStatsJSON());
         return o;
       }
     }
@@ -291,6 +358,12 @@ public:
           err = WebError::webErr(500, "Unknown action for /queue");
         }
         if (Error::isOK(err)) {
+          // rows rendered in advance might be different now
+          ayabComm->invalidateLookahead();
+          // queue has changed, needle data must be recompiled
+          // (but not for every single request when a batch of files is added)
+          MainLoop::currentMainLoop().cancelExecutionTicket(programTicket);
+          programTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::updateKnitProgram, this), 2*Second);
           // restart needed?
           if (restartKnitting) {
             MainLoop::currentMainLoop().cancelExecutionTicket(initiateTicket);
@@ -303,6 +376,14 @@ public:
         return patternQueue->queueStateJSON();
       }
     }
+    else if (aUri=="/stats") {
+      // line request latency statistics
+      return ayabComm->latencyStatsJSON();
+    }
+    else if (aUri=="/cache") {
+      // decoded pattern cache statistics
+      return patternQueue->cacheStateJSON();
+    }
     else if (aUri=="/cursor") {
       if (aIsAction) {
         // check action to execute on cursor
@@ -313,6 +394,7 @@ public:
             beginningOfEntry = b->boolValue();
           }
           patternQueue->moveCursor(o->int32Value(), false, beginningOfEntry);
+          ayabComm->invalidateLookahead();
           patternQueue->saveState(statedir.c_str(), false);
         }
       }
@@ -346,8 +428,8 @@ public:
     apiServer->setConnectionParams(NULL, aAPIPort.c_str(), SOCK_STREAM, AF_INET);
     apiServer->setAllowNonlocalConnections(getOption("jsonapinonlocal"));
     apiServer->startServer(boost::bind(&P44ayabd::apiConnectionHandler, this, _1), 3);
-    // start knitting whatever is in the queue
-    initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this), 3*Second);
+    // start knitting whatever is in the queue (AYAB has responded after restart already)
+    initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this));
   }
 
 
@@ -361,7 +443,7 @@ public:
     err = patternQueue->addFile(aPNGfilename, "single_PNG");
     if (Error::isOK(err)) {
       // start knitting it
-      initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this), 3*Second);
+      initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this));
     }
     else {
       terminateAppWith(err);
@@ -376,6 +458,89 @@ public:
   }
 
 
+  void benchmarkModeStart(int aSyntheticRows)
+  {
+    ErrorPtr err;
+    apiMode = false;
+    string p;
+    if (getStringOption("knitpng", p)) {
+      patternQueue->clear();
+      err = patternQueue->addFile(p, "single_PNG");
+    }
+    else {
+      patternQueue->loadState(statedir.c_str());
+    }
+    if (Error::isOK(err)) {
+      patternQueue->moveCursor(0, false);
+      if (patternQueue->endOfPattern() || patternQueue->width()<1) {
+        // nothing to knit, use synthetic pattern
+        LOG(LOG_NOTICE, "Queue is empty - benchmarking with synthetic pattern of %d rows", aSyntheticRows);
+        patternQueue->clear();
+        patternQueue->setWidth(BENCHMARK_WIDTH);
+        err = addSyntheticPattern(aSyntheticRows);
+        patternQueue->moveCursor(0, false);
+      }
+    }
+    if (!Error::isOK(err)) {
+      terminateAppWith(err);
+      return;
+    }
+    // compile knit program first, so rows are rendered the same way as in normal operation
+    updateKnitProgram();
+    if (compileThread) {
+      // start as soon as the compiler is done
+      programReadyCB = boost::bind(&P44ayabd::initiateKnitting, this);
+      return;
+    }
+    initiateKnitting();
+  }
+
+
+  /// fill the queue with a synthetic pattern
+  /// @note the pattern is written as PNG files into the state dir, so rows go through decoding, thresholding,
+  ///   packing and the pattern cache exactly like rows of real patterns
+  ErrorPtr addSyntheticPattern(int aRows)
+  {
+    ErrorPtr err;
+    int segments = aRows/BENCHMARK_SEGMENT_ROWS;
+    int rest = aRows%BENCHMARK_SEGMENT_ROWS;
+    if (segments>0) {
+      string pngfile = statedir + "/" BENCHMARK_PNG_FILE_NAME;
+      err = PatternContainer::writeTestPNGFile(pngfile.c_str(), BENCHMARK_WIDTH, BENCHMARK_SEGMENT_ROWS);
+      for (int i=0; i<segments && Error::isOK(err); i++) {
+        err = patternQueue->addFile(pngfile, "benchmark");
+      }
+    }
+    if (rest>0 && Error::isOK(err)) {
+      string pngfile = statedir + "/" BENCHMARK_REST_PNG_FILE_NAME;
+      err = PatternContainer::writeTestPNGFile(pngfile.c_str(), BENCHMARK_WIDTH, rest);
+      if (Error::isOK(err)) {
+        err = patternQueue->addFile(pngfile, "benchmark");
+      }
+    }
+    return err;
+  }
+
+
+  void benchmarkDone()
+  {
+    JsonObjectPtr r = ayabComm->benchmarkStatsJSON();
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    r->add("cpuUserMS", JsonObject::newInt64((int64_t)ru.ru_utime.tv_sec*1000+ru.ru_utime.tv_usec/1000));
+    r->add("cpuSystemMS", JsonObject::newInt64((int64_t)ru.ru_stime.tv_sec*1000+ru.ru_stime.tv_usec/1000));
+    #ifdef __APPLE__
+    r->add("peakRSSKB", JsonObject::newInt64(ru.ru_maxrss/1024)); // bytes on OS X
+    #else
+    r->add("peakRSSKB", JsonObject::newInt64(ru.ru_maxrss)); // kilobytes on Linux
+    #endif
+    r->add("programValid", JsonObject::newBool(knitProgram->isValid()));
+    printf("%s\n", r->c_strValue());
+    fflush(stdout);
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
   void restartAyab(bool aWithDisconnect)
   {
     MainLoop::currentMainLoop().cancelExecutionTicket(initiateTicket);
@@ -383,20 +548,122 @@ public:
       ayabComm->restart(boost::bind(&P44ayabd::initiateKnitting, this));
     }
     else {
-      initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this), 3*Second);
+      initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this));
+    }
+  }
+
+
+  void reconfigureKnitting()
+  {
+    // settings apply to the rows not yet sent
+    updateKnitProgram();
+    if (!ayabComm->reconfigureJob(firstNeedle(), patternQueue->width(), boost::bind(&P44ayabd::reconfigureDone, this, _1))) {
+      // no job running: (re)start with new settings, no need to reset AYAB for that
+      restartAyab(false);
+    }
+  }
+
+
+  void reconfigureDone(ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      // AYAB (e.g. older firmware) cannot change the running job, do it the hard way
+      LOG(LOG_WARNING, "Reconfiguring running job failed: %s - restarting AYAB", aError->description().c_str());
+      restartAyab(true);
+    }
+  }
+
+
+  int firstNeedle()
+  {
+    // pattern is centered on the needle bed
+    return 100-patternQueue->width()/2;
+  }
+
+
+  void updateKnitProgram()
+  {
+    MainLoop::currentMainLoop().cancelExecutionTicket(programTicket);
+    if (compileThread) {
+      return; // compiler busy, will check again when done
+    }
+    if (
+      knitProgram->isValid() &&
+      knitProgram->generation()==patternQueue->contentGeneration() &&
+      knitProgram->firstNeedle()==firstNeedle()
+    ) {
+      return; // still up to date
+    }
+    if (patternQueue->width()<1) {
+      knitProgram->unmap();
+      return; // nothing to compile yet
+    }
+    // compile in a separate thread, decoding all images must not block the mainloop.
+    // Until done, rows will be generated on the fly from the queue.
+    // Note: compiler thread only accesses compilingProgram, compileSource and compileErr, and these
+    //   are not touched by the mainloop until the thread has signalled completion
+    compilingProgram = KnitProgramPtr(new KnitProgram);
+    compileSource = patternQueue->programSource(firstNeedle());
+    compileErr.reset();
+    compileThread = MainLoop::currentMainLoop().executeInThread(
+      boost::bind(&P44ayabd::compileThreadRoutine, this, _1),
+      boost::bind(&P44ayabd::compileThreadSignal, this, _1, _2)
+    );
+  }
+
+
+  void compileThreadRoutine(ChildThreadWrapper &aThread)
+  {
+    // runs in the compiler thread
+    // Note: the old program remains valid while the file is replaced, because its mapping keeps the old file alive
+    string programfile = statedir + "/" KNIT_PROGRAM_FILE_NAME;
+    compileErr = compilingProgram->compile(compileSource, programfile);
+  }
+
+
+  void compileThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
+  {
+    if (aSignalCode!=threadSignalCompleted && aSignalCode!=threadSignalFailedToStart && aSignalCode!=threadSignalCancelled) {
+      return; // not an end-of-thread signal
+    }
+    compileThread.reset();
+    if (aSignalCode!=threadSignalCompleted) {
+      LOG(LOG_ERR, "Knit program compiler thread did not complete");
+    }
+    else if (!Error::isOK(compileErr)) {
+      // not fatal, rows will be generated on the fly from the queue
+      LOG(LOG_ERR, "Could not compile knit program: %s", compileErr->description().c_str());
+    }
+    else {
+      // switch to the new program (old one gets unmapped when released)
+      knitProgram = compilingProgram;
+      // now rows can be rendered in advance
+      ayabComm->invalidateLookahead();
+    }
+    compilingProgram.reset();
+    compileSource.entries.clear();
+    // queue might have changed while compiling
+    if (compileSource.generation!=patternQueue->contentGeneration() || compileSource.firstNeedle!=firstNeedle()) {
+      updateKnitProgram();
+    }
+    if (!compileThread && programReadyCB) {
+      SimpleCB cb = programReadyCB;
+      programReadyCB = NULL;
+      cb();
     }
   }
 
 
   void initiateKnitting()
   {
+    // make sure needle data gets up to date with current queue and settings
+    updateKnitProgram();
     // height of image is width of knit
     int w = patternQueue->width();
-    if (!ayabComm->startKnittingJob(100-w/2, w, boost::bind(&P44ayabd::rowCallBack, this, _1, _2))) {
-      // repeat in case of immediate failure
-      // (Note: usually rowCallBack will be called with Error as long as machine is not ready)
-      MainLoop::currentMainLoop().cancelExecutionTicket(initiateTicket);
-      initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this), 3*Second);
+    if (!ayabComm->startKnittingJob(firstNeedle(), w, boost::bind(&P44ayabd::rowCallBack, this, _1, _2, _3))) {
+      // nothing that can be knitted in the queue, adding to the queue will initiate knitting again
+      // (Note: AyabComm itself waits for the machine to become ready)
+      LOG(LOG_NOTICE, "Nothing to knit (width=%d) - waiting for queue to change", w);
       return;
     }
     patternQueue->resetPhase();
@@ -404,42 +671,86 @@ public:
   }
 
 
-  AyabRowPtr rowCallBack(int aRowNum, ErrorPtr aError)
+  bool programUpToDate()
+  {
+    return
+      knitProgram->generation()==patternQueue->contentGeneration() &&
+      knitProgram->firstNeedle()==firstNeedle();
+  }
+
+
+  void advanceRow()
+  {
+    // if started fresh, no nextPhase() is needed
+    // Note: we could put nextPhase() call immediately after sending the row, but then cursor position
+    //   would show next phase (color, row) instead of current one. That's why we call next not before
+    //   actually sending the next row to the machine
+    if (!firstPhase) {
+      patternQueue->nextPhase(); // next
+    }
+    firstPhase = false;
+    // check for end of knit
+    if (patternQueue->endOfPattern() && !apiMode && !benchmarkMode) {
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::doneSimpleMode, this), 2*Second);
+    }
+  }
+
+
+  bool peekRow(int aAhead, AyabRow &aRow)
+  {
+    // rows can only be rendered in advance from an up-to-date knit program
+    if (!programUpToDate()) return false;
+    // the row the next rowCallBack() will return is one nextPhase() ahead, except when started fresh
+    int pos;
+    int phase = patternQueue->phaseAhead((firstPhase ? 0 : 1)+aAhead, pos);
+    if (pos>=patternQueue->imageStartPos()) {
+      // end of pattern
+      aRow.endOfJob = true;
+      return true;
+    }
+    const uint8_t *needles = knitProgram->needlesAt(pos, patternQueue->phaseInverted(phase));
+    if (!needles) return false;
+    aRow.needles.setBits(needles, KNITPROGRAM_ROW_BYTES*8);
+    return true;
+  }
+
+
+  void rowCallBack(int aRowNum, ErrorPtr aError, AyabRow &aRow)
   {
-    AyabRowPtr row;
     if (!Error::isOK(aError)) {
       LOG(LOG_ERR, "Knitting job aborted with error: %s\n", aError->description().c_str());
-      // probably machine not yet ready - try restarting in a moment
+      // AYAB did not respond properly - try again in a moment
       MainLoop::currentMainLoop().cancelExecutionTicket(initiateTicket);
       initiateTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::initiateKnitting, this), 3*Second);
+      return;
+    }
+    advanceRow();
+    if (patternQueue->endOfPattern()) {
+      aRow.endOfJob = true;
+      return;
+    }
+    // there is a row, return it
+    const uint8_t *needles = NULL;
+    if (programUpToDate()) {
+      // knit program is up to date, cursor is just an index into it
+      needles = knitProgram->needlesAt(patternQueue->cursorPosition(), patternQueue->phaseInverted());
+    }
+    if (needles) {
+      aRow.needles.setBits(needles, KNITPROGRAM_ROW_BYTES*8);
     }
     else {
-      // if started fresh, no nextPhase() is needed
-      // Note: we could put nextPhase() call immediately after sending the row, but then cursor position
-      //   would show next phase (color, row) instead of current one. That's why we call next not before
-      //   actually sending the next row to the machine
-      if (!firstPhase) {
-        patternQueue->nextPhase(); // next
-      }
-      firstPhase = false;
-      if (!patternQueue->endOfPattern()) {
-        // there is a row, return it
-        int w = patternQueue->width();
-        row = AyabRowPtr(new AyabRow);
-        row->setRowSize(w);
-        for (int y=w-1; y>=0; --y) {
-          row->setRowPixel(y, patternQueue->needleAtCursor(y));
-        }
-      }
-      // check for end of knit
-      if (!row && !apiMode) {
-        MainLoop::currentMainLoop().executeOnce(boost::bind(&P44ayabd::doneSimpleMode, this), 2*Second);
-      }
+      // no usable program, generate row from queue
+      int w = patternQueue->width();
+      if (w>KNITPROGRAM_ROW_BYTES*8) return; // cannot be knitted anyway, leave row empty
+      uint8_t bits[KNITPROGRAM_ROW_BYTES];
+      patternQueue->needlesAtCursor(bits);
+      aRow.needles.setBits(bits, w);
+      // pattern is knitted in inverse direction, starting at firstNeedle
+      aRow.needles.reverse(w);
+      aRow.needles.shift(firstNeedle());
     }
-    return row;
   };
 
-
 };
 
 
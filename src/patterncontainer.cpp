@@ -21,12 +21,17 @@
 
 #include "patterncontainer.hpp"
 
+#include "needlepack.hpp"
+
 
 using namespace p44;
 
+#define TRANSPOSE_BLOCK_SIZE 32 // number of image columns transposed at a time, to stay within cache
+
 
 PatternContainer::PatternContainer() :
-  pngBuffer(NULL),
+  planes(NULL),
+  planeRowBytes(0),
   patternWidth(0),
   patternLength(0),
   imgOffsetW(0),
@@ -46,20 +51,21 @@ void PatternContainer::clear()
   // init libpng image structure
   memset(&pngImage, 0, (sizeof pngImage));
   pngImage.version = PNG_IMAGE_VERSION;
-  // free the buffer if allocated
-  if (pngBuffer) {
-    free(pngBuffer);
-    pngBuffer = NULL;
+  // free the planes if allocated
+  if (planes) {
+    free(planes);
+    planes = NULL;
   }
+  planeRowBytes = 0;
 }
 
 
 void PatternContainer::dumpPatternToConsole()
 {
-  if (pngBuffer) {
+  if (planes) {
     for (int x=0; x<patternLength; x++) {
       for (int y=patternWidth-1; y>=0; --y) {
-        fputc(grayAt(x, y)<128 ? 'X' : '.', stdout);
+        fputc(colorAt(x, y)==0 ? 'X' : '.', stdout);
       }
       fprintf(stdout, "\n");
     }
@@ -82,27 +88,39 @@ ErrorPtr PatternContainer::readPNGfromFile(const char *aPNGFileName)
     // Now allocate enough memory to hold the image in this format; the
     // PNG_IMAGE_SIZE macro uses the information about the image (width,
     // height and format) stored in 'image'.
-    pngBuffer = (png_bytep)malloc(PNG_IMAGE_SIZE(pngImage));
+    png_bytep imageBuffer = (png_bytep)malloc(PNG_IMAGE_SIZE(pngImage));
     LOG(LOG_INFO, "Image size in bytes = %d", PNG_IMAGE_SIZE(pngImage));
     LOG(LOG_INFO, "Image width = %d", pngImage.width);
     LOG(LOG_INFO, "Image height = %d", pngImage.height);
     LOG(LOG_INFO, "Image width*height = %d", pngImage.height*pngImage.width);
-    if (pngBuffer==NULL) {
+    if (imageBuffer==NULL) {
       return TextError::err("Could not allocate buffer for reading PNG file %s", aPNGFileName);
     }
     // now actually red the image
     if (png_image_finish_read(
       &pngImage,
       NULL, // background
-      pngBuffer,
+      imageBuffer,
       0, // row_stride
       NULL //colormap
     ) == 0) {
       // error
       ErrorPtr err = TextError::err("Error reading PNG file %s: error: %s", aPNGFileName, pngImage.message);
+      free(imageBuffer);
       clear(); // clear only after pngImage.message has been used
       return err;
     }
+    // banner is knitted sidewards, so transpose image to get knit rows as contiguous spans,
+    // and threshold it once into packed bitplanes (we only need color/no color per needle)
+    planeRowBytes = (pngImage.height+7)/8;
+    planes = (uint8_t *)malloc(PATTERN_PLANES*pngImage.width*planeRowBytes);
+    if (planes==NULL) {
+      free(imageBuffer);
+      clear();
+      return TextError::err("Could not allocate bitplanes for PNG file %s", aPNGFileName);
+    }
+    transposeAndPackImage(imageBuffer);
+    free(imageBuffer);
   }
   // image read ok
   // - set size (Note: width and length reversed, as we need the pattern sidewards)
@@ -112,6 +130,131 @@ ErrorPtr PatternContainer::readPNGfromFile(const char *aPNGFileName)
 }
 
 
+static uint32_t pngCRC(const uint8_t *aData, size_t aNumBytes)
+{
+  // bitwise CRC-32 as specified for PNG chunks (only ever used for the few IHDR bytes)
+  uint32_t crc = 0xFFFFFFFF;
+  while (aNumBytes--) {
+    crc ^= *aData++;
+    for (int k=0; k<8; k++) {
+      crc = crc & 1 ? 0xEDB88320 ^ (crc>>1) : crc>>1;
+    }
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+
+static uint32_t pngUInt32(const uint8_t *aData)
+{
+  return ((uint32_t)aData[0]<<24) | ((uint32_t)aData[1]<<16) | ((uint32_t)aData[2]<<8) | aData[3];
+}
+
+
+ErrorPtr PatternContainer::probePNGFile(const char *aPNGFileName, int &aLength, int &aWidth)
+{
+  // PNG signature (8 bytes), followed by IHDR chunk: length (4), type (4), data (13), CRC (4)
+  uint8_t hdr[33];
+  FILE *f = fopen(aPNGFileName, "r");
+  if (!f) {
+    return TextError::err("could not open PNG file %s", aPNGFileName);
+  }
+  size_t n = fread(hdr, 1, sizeof(hdr), f);
+  fclose(f);
+  if (n!=sizeof(hdr) || png_sig_cmp(hdr, 0, 8)!=0) {
+    return TextError::err("%s is not a PNG file", aPNGFileName);
+  }
+  if (pngUInt32(hdr+8)!=13 || memcmp(hdr+12, "IHDR", 4)!=0 || pngCRC(hdr+12, 17)!=pngUInt32(hdr+29)) {
+    return TextError::err("PNG file %s has no valid IHDR header", aPNGFileName);
+  }
+  uint32_t w = pngUInt32(hdr+16);
+  uint32_t h = pngUInt32(hdr+20);
+  uint8_t bitDepth = hdr[24];
+  uint8_t colorType = hdr[25];
+  bool depthOk = false;
+  switch (colorType) {
+    case PNG_COLOR_TYPE_GRAY: depthOk = bitDepth==1 || bitDepth==2 || bitDepth==4 || bitDepth==8 || bitDepth==16; break;
+    case PNG_COLOR_TYPE_PALETTE: depthOk = bitDepth==1 || bitDepth==2 || bitDepth==4 || bitDepth==8; break;
+    case PNG_COLOR_TYPE_RGB:
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+    case PNG_COLOR_TYPE_RGB_ALPHA: depthOk = bitDepth==8 || bitDepth==16; break;
+  }
+  if (
+    w==0 || w>PNG_UINT_31_MAX || h==0 || h>PNG_UINT_31_MAX ||
+    !depthOk ||
+    hdr[26]!=0 || hdr[27]!=0 || hdr[28]>1 // compression, filter, interlace
+  ) {
+    return TextError::err("PNG file %s has invalid IHDR: %ux%u, bit depth %d, color type %d", aPNGFileName, w, h, bitDepth, colorType);
+  }
+  LOG(LOG_INFO, "Probed PNG %s: width = %u, height = %u, bit depth = %d, color type = %d", aPNGFileName, w, h, bitDepth, colorType);
+  // Note: width and length reversed, as we need the pattern sidewards
+  aLength = w;
+  aWidth = h;
+  return ErrorPtr();
+}
+
+
+void PatternContainer::transposeAndPackImage(png_bytep aImageBuffer)
+{
+  // image rows (pngImage.width pixels each) become knit rows (pngImage.height needles each)
+  // Note: done in blocks of image columns, transposed into a small buffer that stays within the cache,
+  //   from which the knit rows are then thresholded and packed by the vectorized kernel
+  const int iw = pngImage.width;
+  const int ih = pngImage.height;
+  uint8_t *block = new uint8_t[TRANSPOSE_BLOCK_SIZE*ih];
+  for (int bx=0; bx<iw; bx+=TRANSPOSE_BLOCK_SIZE) {
+    int n = iw-bx<TRANSPOSE_BLOCK_SIZE ? iw-bx : TRANSPOSE_BLOCK_SIZE;
+    for (int y=0; y<ih; y++) {
+      const png_byte *src = aImageBuffer+y*iw+bx;
+      for (int k=0; k<n; k++) {
+        block[k*ih+y] = src[k];
+      }
+    }
+    // FIXME: only works for 2 colors and B&W input template
+    // pixel information is amount of white, color is when amount of black>PATTERN_THRESHOLD
+    for (int k=0; k<n; k++) {
+      thresholdAndPack(block+k*ih, ih, 255-PATTERN_THRESHOLD-1, false, planes+(bx+k)*planeRowBytes);
+    }
+  }
+  delete[] block;
+}
+
+
+size_t PatternContainer::memorySize()
+{
+  if (!planes) return 0;
+  return (size_t)PATTERN_PLANES*pngImage.width*planeRowBytes;
+}
+
+
+ErrorPtr PatternContainer::writeTestPNGFile(const char *aPNGFileName, int aWidth, int aLength)
+{
+  png_image img;
+  memset(&img, 0, (sizeof img));
+  img.version = PNG_IMAGE_VERSION;
+  img.format = PNG_FORMAT_GRAY;
+  // banner is knitted sidewards: image width is the pattern length
+  img.width = aLength;
+  img.height = aWidth;
+  png_bytep imageBuffer = (png_bytep)malloc(PNG_IMAGE_SIZE(img));
+  if (imageBuffer==NULL) {
+    return TextError::err("Could not allocate buffer for writing PNG file %s", aPNGFileName);
+  }
+  // diagonal stripes, varied along the length, so no two neighbouring rows are alike
+  for (int y=0; y<aWidth; y++) {
+    for (int x=0; x<aLength; x++) {
+      imageBuffer[y*aLength+x] = (((x/3)^(y/5))+x/17) & 1 ? 0 : 255; // black = color
+    }
+  }
+  if (png_image_write_to_file(&img, aPNGFileName, 0, imageBuffer, 0, NULL)==0) {
+    ErrorPtr err = TextError::err("Error writing PNG file %s: error: %s", aPNGFileName, img.message);
+    free(imageBuffer);
+    return err;
+  }
+  free(imageBuffer);
+  return ErrorPtr();
+}
+
+
 void PatternContainer::setSize(int aWidth, int aLength)
 {
   patternWidth = aWidth;
@@ -126,10 +269,10 @@ void PatternContainer::setContentOffset(int aOffsetW, int aOffsetL)
 }
 
 
-uint8_t PatternContainer::grayAt(int aAtLenght, int aAtWidth)
+int PatternContainer::colorAt(int aAtLenght, int aAtWidth)
 {
   if (
-    pngBuffer == NULL ||
+    planes == NULL ||
     aAtLenght<0 || aAtLenght>=length() ||
     aAtWidth<0 || aAtWidth>=width()
   ) {
@@ -144,10 +287,59 @@ uint8_t PatternContainer::grayAt(int aAtLenght, int aAtWidth)
   ) {
     return 0; // outside image -> no color
   }
-  // inside image, return level of gray/black
-  return 255-pngBuffer[aAtWidth*length()+aAtLenght]; // pixel information is amount of white, we want amount of black
+  // inside image, return first color plane that has the bit set
+  for (int p=0; p<PATTERN_PLANES; p++) {
+    if (planeSpan(aAtLenght, p)[aAtWidth>>3] & (1<<(aAtWidth & 0x07))) return p+1;
+  }
+  return 0;
+}
+
+
+/// get 8 bits starting at any bit position
+static inline uint8_t bitsAt(const uint8_t *aBits, int aBitPos, int aNumBytes)
+{
+  int i = aBitPos>>3;
+  int sh = aBitPos & 0x07;
+  uint8_t b = aBits[i]>>sh;
+  if (sh && i+1<aNumBytes) b |= aBits[i+1]<<(8-sh);
+  return b;
 }
 
 
+void PatternContainer::getPlaneRow(int aAtLength, int aFromWidth, int aNumWidth, int aPlane, uint8_t *aBits)
+{
+  // no color by default
+  int nb = (aNumWidth+7)>>3;
+  memset(aBits, 0, nb);
+  if (planes==NULL || aAtLength<0 || aAtLength>=length() || aPlane<0 || aPlane>=PATTERN_PLANES) return; // outside pattern
+  // restrict to pattern
+  int w = aFromWidth;
+  int e = aFromWidth+aNumWidth;
+  if (w<0) w = 0;
+  if (e>width()) e = width();
+  // restrict to image (apply offsets)
+  const uint8_t *span = planeSpan(aAtLength-imgOffsetL, aPlane);
+  if (!span) return; // outside image
+  if (w<imgOffsetW) w = imgOffsetW;
+  if (e>imgOffsetW+(int)pngImage.height) e = imgOffsetW+pngImage.height;
+  // copy bytewise, shifted into place
+  int sb = w-imgOffsetW; // first source bit
+  int db = w-aFromWidth; // first destination bit
+  int dsh = db & 0x07;
+  uint8_t *d = aBits+(db>>3);
+  for (int n=e-w; n>0; n-=8) {
+    uint8_t b = bitsAt(span, sb, planeRowBytes);
+    if (n<8) b &= (1<<n)-1; // last partial byte
+    *d |= b<<dsh;
+    if (dsh && d+1<aBits+nb) *(d+1) |= b>>(8-dsh);
+    d++;
+    sb += 8;
+  }
+}
 
 
+const uint8_t *PatternContainer::planeSpan(int aAtLength, int aPlane)
+{
+  if (planes==NULL || aAtLength<0 || aAtLength>=pngImage.width) return NULL;
+  return planes+(aPlane*pngImage.width+aAtLength)*planeRowBytes;
+}
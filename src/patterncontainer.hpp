@@ -35,12 +35,16 @@ class PatternContainer;
 
 typedef boost::intrusive_ptr<PatternContainer> PatternContainerPtr;
 
+#define PATTERN_PLANES 1 ///< FIXME: only 2 colors and B&W input template for now: one plane for color 1, no bit set = color 0 (background)
+#define PATTERN_THRESHOLD 128 ///< amount of black above which a pixel has a color
+
 class PatternContainer : public P44Obj
 {
   typedef P44Obj inherited;
 
   png_image pngImage; ///< The control structure used by libpng
-  png_bytep pngBuffer; ///< byte buffer
+  uint8_t *planes; ///< packed bitplanes, one per color, each knit row (image column) is a contiguous span of planeRowBytes bytes, first needle in bit0
+  int planeRowBytes; ///< number of bytes per knit row in a plane
 
   int patternWidth; ///< the width
   int patternLength; ///< the length
@@ -58,6 +62,20 @@ public:
   /// read pattern from file
   ErrorPtr readPNGfromFile(const char *aPNGFileName);
 
+  /// get size of a pattern in a PNG file without decoding it (just reads and checks the PNG header)
+  /// @param aPNGFileName the PNG file
+  /// @param aLength will be set to the length of the pattern (width of the image)
+  /// @param aWidth will be set to the width of the pattern (height of the image)
+  /// @return ok if file has a valid PNG header, error otherwise
+  static ErrorPtr probePNGFile(const char *aPNGFileName, int &aLength, int &aWidth);
+
+  /// write a synthetic test pattern (e.g. for benchmarking) to a PNG file
+  /// @param aPNGFileName the PNG file to (re)create
+  /// @param aWidth width of the pattern (height of the image)
+  /// @param aLength length of the pattern (width of the image)
+  /// @return ok or error
+  static ErrorPtr writeTestPNGFile(const char *aPNGFileName, int aWidth, int aLength);
+
   /// set size for pattern
   void setSize(int aWidth, int aLength);
 
@@ -74,6 +92,9 @@ public:
   /// get pattern length
   int length() { return patternLength; };
 
+  /// @return number of bytes of decoded pattern data held by this container
+  size_t memorySize();
+
   /// get image offset in width
   int offsetW() { return imgOffsetW; };
 
@@ -81,11 +102,28 @@ public:
   int offsetL() { return imgOffsetL; };
 
 
-  /// get gray value at given point
-  uint8_t grayAt(int aAtLenght, int aAtWidth);
+  /// get color number at given point
+  /// @return color number (0=background, 1..PATTERN_PLANES=other colors)
+  int colorAt(int aAtLenght, int aAtWidth);
+
+  /// get bits of a range of needles in a knit row from one color plane at once
+  /// @param aAtLength the knit row
+  /// @param aFromWidth first needle (width coordinate) to get
+  /// @param aNumWidth number of needles to get
+  /// @param aPlane color plane (0..PATTERN_PLANES-1 for colors 1..PATTERN_PLANES)
+  /// @param aBits buffer for (aNumWidth+7)/8 bytes, first needle in bit0 of first byte
+  void getPlaneRow(int aAtLength, int aFromWidth, int aNumWidth, int aPlane, uint8_t *aBits);
+
+  /// get raw plane data of a knit row
+  /// @param aAtLength the knit row, in image coordinates (not adjusted for content offset)
+  /// @param aPlane color plane
+  /// @return pointer to contiguous packed bits for all image pixels of that knit row, NULL if none
+  const uint8_t *planeSpan(int aAtLength, int aPlane);
 
 private:
 
+  void transposeAndPackImage(png_bytep aImageBuffer);
+
 };
 
 
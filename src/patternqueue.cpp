@@ -21,21 +21,47 @@
 
 #include "patternqueue.hpp"
 
+#include <algorithm>
+
 using namespace p44;
 
 #define QUEUE_STATE_FILE_NAME "p44ayabd_queuestate.json"
 
+#define PREFETCH_DELAY (100*MilliSecond) // let row answers go out first, decode afterwards
+
 PatternQueue::PatternQueue() :
-  stateDirty(false)
+  stateDirty(false),
+  generation(0),
+  cacheBudget(DEFAULT_PATTERN_CACHE_BUDGET),
+  cacheLookahead(DEFAULT_PATTERN_CACHE_LOOKAHEAD),
+  cacheBytes(0),
+  useCounter(0),
+  cacheHits(0),
+  cacheMisses(0),
+  cacheEvictions(0),
+  cachePrefetches(0),
+  prefetchTicket(0)
 {
   clear();
 }
 
 
+PatternQueue::~PatternQueue()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(prefetchTicket);
+  if (decodeThread) {
+    decodeThread->cancel();
+    decodeThread.reset();
+  }
+}
+
+
 void PatternQueue::clear()
 {
   // clear queue
   queue.clear();
+  rebuildEntryIndex();
+  cacheBytes = 0; // all decoded patterns are gone with the queue
   cursorEntry = 0; // first
   rowPhase = 0; // first
   cursorOffset = 0;
@@ -43,6 +69,7 @@ void PatternQueue::clear()
   patternShift = 0; // no offset
   numColors = 2; // default
   ribber = false; // none
+  generation++;
 }
 
 
@@ -50,6 +77,7 @@ ErrorPtr PatternQueue::setWidth(int aWidth)
 {
   patternWidth = aWidth;
   stateDirty = true;
+  generation++;
   return ErrorPtr();
 }
 
@@ -58,6 +86,7 @@ ErrorPtr PatternQueue::setShift(int aShift)
 {
   patternShift = aShift;
   stateDirty = true;
+  generation++;
   return ErrorPtr();
 }
 
@@ -66,6 +95,7 @@ ErrorPtr PatternQueue::setRibberMode(bool aRibber)
 {
   ribber = aRibber;
   stateDirty = true;
+  generation++;
   return ErrorPtr();
 }
 
@@ -74,6 +104,7 @@ ErrorPtr PatternQueue::setColors(int aNumColors)
 {
   numColors = aNumColors;
   stateDirty = true;
+  generation++;
   return ErrorPtr();
 }
 
@@ -83,25 +114,27 @@ ErrorPtr PatternQueue::setColors(int aNumColors)
 
 ErrorPtr PatternQueue::addFile(string aFilePath, string aWebURL)
 {
-  PatternContainerPtr pattern = PatternContainerPtr(new PatternContainer);
-  ErrorPtr err = pattern->readPNGfromFile(aFilePath.c_str());
+  // only check header and get size now, image is decoded later when actually needed
+  int length, width;
+  ErrorPtr err = PatternContainer::probePNGFile(aFilePath.c_str(), length, width);
   if (Error::isOK(err)) {
-    // file could be read
+    // file is a valid PNG
     // - create queue entry
     PatternQueueEntryPtr qe = PatternQueueEntryPtr(new PatternQueueEntry);
     qe->filepath = aFilePath;
     qe->weburl = aWebURL;
-    qe->pattern = pattern;
-    qe->patternLength = pattern->length();
+    qe->patternLength = length;
     // if queue was empty before, also set width
     if (queue.size()==0 && patternWidth==0) {
-      patternWidth = pattern->width();
+      patternWidth = width;
     }
     // - push into queue
     queue.push_back(qe);
+    entryStartPos.push_back(entryStartPos.back()+qe->patternLength);
     stateDirty = true; // new entry, state is dirty now
-    // make sure image under cursor is loaded (and others are not)
-    loadPatternAtCursor();
+    generation++;
+    // new entry might be within lookahead of the cursor
+    schedulePrefetch();
   }
   return err;
 }
@@ -116,9 +149,11 @@ ErrorPtr PatternQueue::addSpace(int aLength)
   qe->patternLength = pattern->length();
   // - push into queue
   queue.push_back(qe);
+  entryStartPos.push_back(entryStartPos.back()+qe->patternLength);
   stateDirty = true; // new entry, state is dirty now
-  // make sure image under cursor is loaded (and others are not)
-  loadPatternAtCursor();
+  generation++;
+  // new entry might be within lookahead of the cursor
+  schedulePrefetch();
   return ErrorPtr();
 }
 
@@ -143,11 +178,21 @@ ErrorPtr PatternQueue::removeSegment(int aIndex, bool aDeleteFile)
     }
   }
   // remove from queue
+  unloadPattern(queue[aIndex]);
   queue.erase(queue.begin()+aIndex);
+  rebuildEntryIndex();
+  generation++;
   if (aIndex<cursorEntry) {
     // removed something before current cursor -> adjust cursor to remain at same position within pattern
     cursorEntry--;
   }
+  else if (aIndex==cursorEntry) {
+    // removed entry under cursor (at its beginning) -> next entry is under cursor now, get it decoded
+    loadPatternAtCursor();
+    return ErrorPtr();
+  }
+  // entries behind the removed one might be within lookahead of the cursor now
+  schedulePrefetch();
   return ErrorPtr();
 }
 
@@ -173,13 +218,20 @@ int PatternQueue::cursorPosition()
 
 int PatternQueue::imageStartPos(int aImageIndex)
 {
-  // calculated: absolute position of cursor within entire queue
-  if (aImageIndex<0) aImageIndex = (int)queue.size(); // size of entire queue
+  if (aImageIndex<0 || aImageIndex>queue.size()) aImageIndex = (int)queue.size(); // size of entire queue
+  return entryStartPos[aImageIndex];
+}
+
+
+void PatternQueue::rebuildEntryIndex()
+{
+  entryStartPos.resize(queue.size()+1);
   int pos = 0;
-  for (int i=0; i<aImageIndex; i++) {
+  for (int i=0; i<queue.size(); i++) {
+    entryStartPos[i] = pos;
     pos += queue[i]->patternLength;
   }
-  return pos;
+  entryStartPos[queue.size()] = pos;
 }
 
 
@@ -201,54 +253,89 @@ uint8_t PatternQueue::activeColors()
 int PatternQueue::colorNoAtCursor(int aAtWidth)
 {
   int currentColorNo = 0;
-  if(cursorEntry<=queue.size()) {
+  if(cursorEntry<queue.size()) {
     PatternQueueEntryPtr qe = queue[cursorEntry];
-    if (!qe->pattern)
-      loadPatternAtCursor();
+    if (!qe->pattern) {
+      // needed right now, cannot wait for the decoder thread
+      loadPattern(qe);
+      qe->lastUse = ++useCounter;
+      trimCache();
+    }
     if (qe->pattern) {
-      // check color
-      // FIXME: only works for 2 colors and B&W input template
-      currentColorNo = qe->pattern->grayAt(cursorOffset, aAtWidth-patternShift)>128 ? 1 : 0;
+      // check color (thresholded into color planes at load time)
+      currentColorNo = qe->pattern->colorAt(cursorOffset, aAtWidth-patternShift);
     }
   }
   return currentColorNo;
 }
 
 
-bool PatternQueue::needleAtCursor(int aAtWidth)
+bool PatternQueue::phaseInverted(int aPhase)
 {
-  int colorNo = colorNoAtCursor(aAtWidth);
-  bool invert = false;
   if (ribber) {
     // FIXME: works for 2 colors only
-    invert = rowPhase==0 || rowPhase==3;
+    return aPhase==0 || aPhase==3;
   }
+  return false;
+}
+
+
+bool PatternQueue::needleAtCursor(int aAtWidth)
+{
+  int colorNo = colorNoAtCursor(aAtWidth);
+  bool invert = phaseInverted();
   bool hascol = colorNo!=0;
   return invert!=hascol; // XOR
 }
 
 
+void PatternQueue::needlesAtCursor(uint8_t *aBits)
+{
+  int nb = (patternWidth+7)/8;
+  memset(aBits, 0, nb);
+  if (cursorEntry<queue.size()) {
+    PatternQueueEntryPtr qe = queue[cursorEntry];
+    if (!qe->pattern) {
+      // needed right now, cannot wait for the decoder thread
+      loadPattern(qe);
+      qe->lastUse = ++useCounter;
+      trimCache();
+    }
+    // FIXME: only works for 2 colors and B&W input template
+    qe->pattern->getPlaneRow(cursorOffset, -patternShift, patternWidth, 0, aBits);
+  }
+  if (phaseInverted()) {
+    for (int i=0; i<nb; i++) aBits[i] = ~aBits[i];
+    if (patternWidth & 0x07) aBits[nb-1] &= (1<<(patternWidth & 0x07))-1; // unused bits must remain zero
+  }
+}
+
+
 void PatternQueue::resetPhase()
 {
   rowPhase = 0; // reset
 }
 
 
-int PatternQueue::nextPhase()
+bool PatternQueue::advancePhase(int &aPhase)
 {
-  bool advanceCursor = false;
   if (!ribber) {
-    rowPhase = 0; // always 0
-    advanceCursor = true;
+    aPhase = 0; // always 0
+    return true;
   }
   else {
     // FIXME: works for 2 colors only
-    rowPhase++;
-    if (rowPhase>=numColors*2) rowPhase = 0;
-    if (rowPhase==0 || rowPhase==2) advanceCursor = true;
+    aPhase++;
+    if (aPhase>=numColors*2) aPhase = 0;
+    return aPhase==0 || aPhase==2;
   }
+}
+
+
+int PatternQueue::nextPhase()
+{
   // advance image cursor?
-  if (advanceCursor) {
+  if (advancePhase(rowPhase)) {
     // move to next
     moveCursor(1, true, false, true); // keep phase
   }
@@ -256,6 +343,18 @@ int PatternQueue::nextPhase()
 }
 
 
+int PatternQueue::phaseAhead(int aSteps, int &aPosition)
+{
+  int phase = rowPhase;
+  int endPos = imageStartPos();
+  aPosition = cursorPosition();
+  for (int i=0; i<aSteps; i++) {
+    if (advancePhase(phase) && aPosition<endPos) aPosition++; // cursor does not move beyond end of queue
+  }
+  return phase;
+}
+
+
 void PatternQueue::moveCursor(int aNewPos, bool aRelative, bool aBeginningOfEntry, bool aKeepPhase)
 {
   int oldCursor = cursorPosition();
@@ -269,24 +368,16 @@ void PatternQueue::moveCursor(int aNewPos, bool aRelative, bool aBeginningOfEntr
     // needs recalculation
     stateDirty = true;
     cursorOffset = 0;
-    cursorEntry = 0;
-    // search image for cursor
-    int pos = 0;
-    while (cursorEntry<queue.size()) {
-      PatternQueueEntryPtr qe = queue[cursorEntry];
-      int newpos = pos+qe->patternLength;
-      if (newCursor<newpos) {
-        // this is the new queue element
-        if (!aBeginningOfEntry)
-          cursorOffset = newCursor-pos;
-        break;
-      }
-      // cursor is higher
-      pos = newpos;
-      cursorEntry++;
+    int oldEntry = cursorEntry;
+    // search image for cursor: first entry ending after the cursor
+    cursorEntry = (int)(std::upper_bound(entryStartPos.begin()+1, entryStartPos.end(), newCursor)-(entryStartPos.begin()+1));
+    if (cursorEntry<queue.size() && !aBeginningOfEntry) {
+      cursorOffset = newCursor-entryStartPos[cursorEntry];
+    }
+    // make sure image under cursor is loaded when entering a new entry
+    if (cursorEntry!=oldEntry) {
+      loadPatternAtCursor();
     }
-    // make sure image under cursor is loaded (and others are not)
-    loadPatternAtCursor();
   }
   LOG(LOG_INFO,
     "Cursor moved from %d to %d, now entry = %d/%lu, offset = %d, endOfPattern = %s",
@@ -298,32 +389,242 @@ void PatternQueue::moveCursor(int aNewPos, bool aRelative, bool aBeginningOfEntr
 }
 
 
+#pragma mark - decoded pattern cache
+
+
+void PatternQueue::setCacheParams(size_t aBudget, int aLookahead)
+{
+  cacheBudget = aBudget;
+  cacheLookahead = aLookahead>=0 ? aLookahead : 0;
+  trimCache();
+  schedulePrefetch();
+}
+
+
 void PatternQueue::loadPatternAtCursor()
 {
-  for (int i=0; i<queue.size(); ++i) {
-    PatternQueueEntryPtr qe = queue[i];
-    if (i==cursorEntry) {
-      // current pattern, must be loaded
-      if (!qe->pattern) {
-        // load it
-        qe->pattern = PatternContainerPtr(new PatternContainer);
-        if (qe->filepath.size()>0) {
-          // actually load from file
-          ErrorPtr err = qe->pattern->readPNGfromFile(qe->filepath.c_str());
-        }
-        else {
-          // just space, create from length
-          qe->pattern->setSize(5, qe->patternLength);
+  if (cursorEntry<queue.size()) {
+    PatternQueueEntryPtr qe = queue[cursorEntry];
+    if (qe->pattern) {
+      cacheHits++;
+      qe->lastUse = ++useCounter;
+    }
+    else {
+      // not prefetched in time, get it decoded as soon as possible
+      // (if needed before decoder is done, colorNoAtCursor() will decode it on the spot)
+      cacheMisses++;
+      MainLoop::currentMainLoop().cancelExecutionTicket(prefetchTicket);
+      prefetchPatterns();
+      return;
+    }
+  }
+  trimCache();
+  schedulePrefetch();
+}
+
+
+void PatternQueue::loadPattern(PatternQueueEntryPtr aEntry)
+{
+  if (aEntry->pattern) return; // already loaded
+  aEntry->pattern = PatternContainerPtr(new PatternContainer);
+  if (aEntry->filepath.size()>0) {
+    // actually load from file
+    ErrorPtr err = aEntry->pattern->readPNGfromFile(aEntry->filepath.c_str());
+    if (!Error::isOK(err)) {
+      LOG(LOG_WARNING, "Cannot load pattern, will knit empty rows: %s", err->description().c_str());
+    }
+  }
+  else {
+    // just space, create from length
+    aEntry->pattern->setSize(5, aEntry->patternLength);
+  }
+  cacheBytes += aEntry->pattern->memorySize();
+}
+
+
+void PatternQueue::unloadPattern(PatternQueueEntryPtr aEntry)
+{
+  if (aEntry->pattern) {
+    cacheBytes -= aEntry->pattern->memorySize();
+    aEntry->pattern.reset();
+  }
+}
+
+
+size_t PatternQueue::estimatedPatternSize(PatternQueueEntryPtr aEntry)
+{
+  if (aEntry->filepath.size()==0) return 0; // space does not need pattern memory
+  return (size_t)PATTERN_PLANES*aEntry->patternLength*((patternWidth+7)/8);
+}
+
+
+void PatternQueue::trimCache()
+{
+  while (cacheBytes>cacheBudget) {
+    // prefer least recently used entry outside the lookahead window,
+    // otherwise drop lookahead entries starting with the farthest one. Never drop the cursor entry.
+    int victim = -1;
+    for (int i=0; i<queue.size(); i++) {
+      PatternQueueEntryPtr qe = queue[i];
+      if (!qe->pattern || (i>=cursorEntry && i<=cursorEntry+cacheLookahead)) continue;
+      if (victim<0 || qe->lastUse<queue[victim]->lastUse) victim = i;
+    }
+    if (victim<0) {
+      for (int i=cursorEntry+cacheLookahead; i>cursorEntry; i--) {
+        if (i<queue.size() && queue[i]->pattern) {
+          victim = i;
+          break;
         }
       }
     }
-    else {
-      qe->pattern.reset();
+    if (victim<0) break; // nothing left to drop
+    LOG(LOG_DEBUG, "Pattern cache: evicting entry %d to stay within budget", victim);
+    unloadPattern(queue[victim]);
+    cacheEvictions++;
+  }
+}
+
+
+void PatternQueue::schedulePrefetch()
+{
+  if (prefetchTicket) return; // already scheduled
+  prefetchTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&PatternQueue::prefetchPatterns, this), PREFETCH_DELAY);
+}
+
+
+void PatternQueue::prefetchPatterns()
+{
+  prefetchTicket = 0;
+  if (decodeThread) return; // decoder busy, will check again when done
+  // bytes that would remain when everything outside the window is dropped
+  size_t windowBytes = 0;
+  int last = cursorEntry+cacheLookahead;
+  for (int i=cursorEntry; i<=last && i<queue.size(); i++) {
+    if (queue[i]->pattern) windowBytes += queue[i]->pattern->memorySize();
+  }
+  // get the nearest missing entry within the window decoded
+  for (int i=cursorEntry; i<=last && i<queue.size(); i++) {
+    PatternQueueEntryPtr qe = queue[i];
+    if (qe->pattern) continue;
+    if (i>cursorEntry && windowBytes+estimatedPatternSize(qe)>cacheBudget) {
+      // does not fit, and nothing further away would fit better
+      break;
+    }
+    if (qe->filepath.size()==0) {
+      // space, nothing to decode
+      loadPattern(qe);
+      qe->lastUse = ++useCounter;
+      continue;
     }
+    LOG(LOG_INFO, "Pattern cache: prefetching entry %d", i);
+    startDecoding(qe);
+    break;
   }
 }
 
 
+void PatternQueue::startDecoding(PatternQueueEntryPtr aEntry)
+{
+  // Note: decoder thread only accesses decodingPattern, decodingFile and decodeErr, and these
+  //   are not touched by the mainloop until the thread has signalled completion
+  decodingEntry = aEntry;
+  decodingPattern = PatternContainerPtr(new PatternContainer);
+  decodingFile = aEntry->filepath;
+  decodeErr.reset();
+  decodeThread = MainLoop::currentMainLoop().executeInThread(
+    boost::bind(&PatternQueue::decodeThreadRoutine, this, _1),
+    boost::bind(&PatternQueue::decodeThreadSignal, this, _1, _2)
+  );
+}
+
+
+void PatternQueue::decodeThreadRoutine(ChildThreadWrapper &aThread)
+{
+  // runs in the decoder thread
+  decodeErr = decodingPattern->readPNGfromFile(decodingFile.c_str());
+}
+
+
+void PatternQueue::decodeThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode)
+{
+  if (aSignalCode!=threadSignalCompleted && aSignalCode!=threadSignalFailedToStart && aSignalCode!=threadSignalCancelled) {
+    return; // not an end-of-thread signal
+  }
+  decodeThread.reset();
+  PatternQueueEntryPtr qe = decodingEntry;
+  PatternContainerPtr pattern = decodingPattern;
+  decodingEntry.reset();
+  decodingPattern.reset();
+  if (aSignalCode!=threadSignalCompleted) {
+    LOG(LOG_ERR, "Pattern decoder thread did not complete");
+    return;
+  }
+  if (!Error::isOK(decodeErr)) {
+    LOG(LOG_WARNING, "Cannot load pattern, will knit empty rows: %s", decodeErr->description().c_str());
+  }
+  // hand over result, unless entry was removed or already decoded on the spot meanwhile
+  bool stillQueued = false;
+  for (PatternQueueVector::iterator pos=queue.begin(); pos!=queue.end(); ++pos) {
+    if (*pos==qe) {
+      stillQueued = true;
+      break;
+    }
+  }
+  if (stillQueued && !qe->pattern) {
+    qe->pattern = pattern;
+    qe->lastUse = ++useCounter;
+    cacheBytes += pattern->memorySize();
+    cachePrefetches++;
+    trimCache();
+  }
+  // check for more
+  schedulePrefetch();
+}
+
+
+JsonObjectPtr PatternQueue::cacheStateJSON()
+{
+  JsonObjectPtr s = JsonObject::newObj();
+  int loaded = 0;
+  for (PatternQueueVector::iterator pos=queue.begin(); pos!=queue.end(); ++pos) {
+    if ((*pos)->pattern) loaded++;
+  }
+  s->add("budget", JsonObject::newInt64(cacheBudget));
+  s->add("lookahead", JsonObject::newInt32(cacheLookahead));
+  s->add("bytes", JsonObject::newInt64(cacheBytes));
+  s->add("entries", JsonObject::newInt32(loaded));
+  s->add("hits", JsonObject::newInt64(cacheHits));
+  s->add("misses", JsonObject::newInt64(cacheMisses));
+  s->add("evictions", JsonObject::newInt64(cacheEvictions));
+  s->add("prefetches", JsonObject::newInt64(cachePrefetches));
+  s->add("decoding", JsonObject::newBool(decodeThread!=NULL));
+  return s;
+}
+
+
+
+
+#pragma mark - knit program
+
+
+KnitProgramSource PatternQueue::programSource(int aFirstNeedle)
+{
+  KnitProgramSource src;
+  src.generation = generation;
+  src.width = patternWidth;
+  src.shift = patternShift;
+  src.ribber = ribber;
+  src.colors = numColors;
+  src.firstNeedle = aFirstNeedle;
+  for (PatternQueueVector::iterator pos=queue.begin(); pos!=queue.end(); ++pos) {
+    KnitProgramSource::Entry e;
+    e.filepath = (*pos)->filepath;
+    e.patternLength = (*pos)->patternLength;
+    src.entries.push_back(e);
+  }
+  return src;
+}
+
 
 
 #pragma mark - state load and save
@@ -382,6 +683,9 @@ void PatternQueue::loadState(const char *aStateDir)
       }
     }
   }
+  rebuildEntryIndex();
+  // get patterns around cursor ready
+  schedulePrefetch();
 }
 
 
@@ -26,14 +26,19 @@
 #include "p44utils_common.hpp"
 
 #include "jsonobject.hpp"
+#include "mainloop.hpp"
 
 #include "patterncontainer.hpp"
+#include "knitprogram.hpp"
 
 
 using namespace std;
 
 namespace p44 {
 
+  #define DEFAULT_PATTERN_CACHE_BUDGET (8*1024*1024) ///< enough for several 5000 rows x 200 needles patterns
+  #define DEFAULT_PATTERN_CACHE_LOOKAHEAD 2 ///< entries after the cursor entry to decode in advance
+
   class PatternQueue;
   class PatternQueueEntry;
 
@@ -47,12 +52,13 @@ namespace p44 {
     typedef P44Obj inherited;
     friend class PatternQueue;
 
-    PatternQueueEntry() : patternLength(0) {};
+    PatternQueueEntry() : patternLength(0), lastUse(0) {};
 
     string filepath;
     string weburl;
     int patternLength;
     PatternContainerPtr pattern;
+    long lastUse; ///< cache use stamp of the decoded pattern, for LRU eviction
 
   };
 
@@ -66,9 +72,11 @@ namespace p44 {
     friend class PatternQueueEntry;
 
     bool stateDirty;
+    long generation; ///< incremented whenever queue content or settings change in a way that affects needle data
 
     // the queue
     PatternQueueVector queue;
+    std::vector<int> entryStartPos; ///< start position of each entry within queue, plus end of queue as last element
     // the cursor
     int cursorEntry; ///< the entry where the cursor is currently in
     int cursorOffset; ///< the position within the entry
@@ -84,9 +92,28 @@ namespace p44 {
     bool ribber; ///< if set: mode for ribber + color changer
     int numColors; ///< number of colors
 
+    // the decoded pattern cache
+    size_t cacheBudget; ///< max number of bytes of decoded pattern data to keep
+    int cacheLookahead; ///< number of entries following the cursor entry to keep decoded
+    size_t cacheBytes; ///< number of bytes of decoded pattern data currently held
+    long useCounter; ///< incremented for every cache access, for LRU
+    long cacheHits; ///< cursor entered an entry that was already decoded
+    long cacheMisses; ///< cursor entered an entry that had to be decoded on the spot
+    long cacheEvictions; ///< decoded entries dropped to stay within budget
+    long cachePrefetches; ///< entries decoded in advance
+    long prefetchTicket; ///< pending prefetch
+
+    // the background decoder
+    ChildThreadWrapperPtr decodeThread; ///< decoder thread, set while decoding
+    PatternQueueEntryPtr decodingEntry; ///< the entry being decoded
+    PatternContainerPtr decodingPattern; ///< the container being filled by the decoder thread
+    string decodingFile; ///< the file being decoded
+    ErrorPtr decodeErr; ///< decoding result, only valid after decoder thread has completed
+
   public:
 
     PatternQueue();
+    virtual ~PatternQueue();
 
     /// clear queue
     void clear();
@@ -116,10 +143,27 @@ namespace p44 {
     /// @return color number (0=background, 1..3=other colors)
     int colorNoAtCursor(int aAtWidth);
 
+    /// @return true if needles are inverted in the current phase (ribber mode)
+    bool phaseInverted() { return phaseInverted(rowPhase); };
+
+    /// @param aPhase row phase
+    /// @return true if needles are inverted in the specified phase (ribber mode)
+    bool phaseInverted(int aPhase);
+
+    /// Calculate the state a number of nextPhase() calls ahead, without changing anything
+    /// @param aSteps number of nextPhase() steps to look ahead
+    /// @param aPosition will be set to the cursor position after aSteps
+    /// @return phase number after aSteps
+    int phaseAhead(int aSteps, int &aPosition);
+
     /// get activation state of needle at cursor in current phase
     /// @param aAtWith needle number where to check status
     bool needleAtCursor(int aAtWidth);
 
+    /// get activation state of all needles at cursor in current phase at once
+    /// @param aBits buffer for (width()+7)/8 bytes, needle 0 in bit0 of first byte
+    void needlesAtCursor(uint8_t *aBits);
+
     /// Start new phase, auto-increments cursor when new pattern row is needed for phase started with this call
     /// @return returns phase number
     int nextPhase();
@@ -157,10 +201,24 @@ namespace p44 {
     /// @param set number of colors
     ErrorPtr setColors(int aNumColors);
 
+    /// @return content generation, changes whenever queue content or settings change
+    long contentGeneration() { return generation; };
+
+    /// get snapshot of queue contents and settings to compile a knit program from
+    /// @param aFirstNeedle first machine needle the pattern will be knitted on
+    KnitProgramSource programSource(int aFirstNeedle);
+
+    /// set up the decoded pattern cache
+    /// @param aBudget max number of bytes of decoded pattern data to keep. The entry under the cursor
+    ///   is always kept, even if it alone exceeds the budget
+    /// @param aLookahead number of entries following the cursor entry to decode in advance
+    void setCacheParams(size_t aBudget, int aLookahead);
+
     /// get state as JSON
     JsonObjectPtr cursorStateJSON();
     JsonObjectPtr queueEntriesJSON();
     JsonObjectPtr queueStateJSON();
+    JsonObjectPtr cacheStateJSON();
 
     /// add a file to the queue
     /// @param aFilePath the file system path to the file to add
@@ -182,7 +240,18 @@ namespace p44 {
 
   private:
 
+    void rebuildEntryIndex();
+    bool advancePhase(int &aPhase);
     void loadPatternAtCursor();
+    void loadPattern(PatternQueueEntryPtr aEntry);
+    void unloadPattern(PatternQueueEntryPtr aEntry);
+    size_t estimatedPatternSize(PatternQueueEntryPtr aEntry);
+    void trimCache();
+    void schedulePrefetch();
+    void prefetchPatterns();
+    void startDecoding(PatternQueueEntryPtr aEntry);
+    void decodeThreadRoutine(ChildThreadWrapper &aThread);
+    void decodeThreadSignal(ChildThreadWrapper &aChildThread, ThreadSignals aSignalCode);
 
   };
 
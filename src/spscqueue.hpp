@@ -0,0 +1,88 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44ayabd.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44ayabd__spscqueue__
+#define __p44ayabd__spscqueue__
+
+#include <stdint.h>
+
+namespace p44 {
+
+  /// lock-free, fixed size single producer/single consumer queue for passing plain value items between two threads
+  /// @note exactly one thread may call push(), and exactly one (other) thread may call front(), pop() and drop().
+  ///   Items are copied in and out, so T must be a plain value type (no pointers to refcounted objects!)
+  /// @note uses the gcc __atomic builtins (gcc 4.7 and later) for the head/tail indices
+  template<typename T, uint32_t N> class SPSCQueue
+  {
+    T items[N];
+    uint32_t head; ///< count of items taken so far, only written by consumer
+    uint32_t tail; ///< count of items put so far, only written by producer
+
+  public:
+
+    SPSCQueue() : head(0), tail(0) {};
+
+    /// put an item (producer only)
+    /// @return false if queue is full
+    bool push(const T &aItem)
+    {
+      uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+      if (t-__atomic_load_n(&head, __ATOMIC_ACQUIRE)>=N) return false; // full
+      items[t % N] = aItem;
+      __atomic_store_n(&tail, t+1, __ATOMIC_RELEASE); // publish item
+      return true;
+    };
+
+    /// access the oldest item without taking it (consumer only)
+    /// @return pointer to the item, valid until pop() or drop(), NULL if queue is empty
+    T *front()
+    {
+      uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+      if (h==__atomic_load_n(&tail, __ATOMIC_ACQUIRE)) return NULL; // empty
+      return &items[h % N];
+    };
+
+    /// remove the oldest item (consumer only, queue must not be empty)
+    void drop()
+    {
+      __atomic_store_n(&head, __atomic_load_n(&head, __ATOMIC_RELAXED)+1, __ATOMIC_RELEASE); // free slot
+    };
+
+    /// take the oldest item (consumer only)
+    /// @return false if queue is empty
+    bool pop(T &aItem)
+    {
+      T *i = front();
+      if (!i) return false;
+      aItem = *i;
+      drop();
+      return true;
+    };
+
+    /// @return number of items in the queue (snapshot, exact only when called from producer or consumer with the other side idle)
+    uint32_t size() { return __atomic_load_n(&tail, __ATOMIC_ACQUIRE)-__atomic_load_n(&head, __ATOMIC_ACQUIRE); };
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44ayabd__spscqueue__) */